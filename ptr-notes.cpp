@@ -9,37 +9,140 @@
 #include <iostream>
 #include <vector>
 #include <memory> // For std::unique_ptr and std::move
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <iomanip>
+#include <stdexcept>
+#include <type_traits>
+#include <cstddef>  // For offsetof, std::max_align_t
+#include <new>      // For std::align_val_t
+#include <algorithm>
+#include <map>
+#include <list>
+#include <set>
+#include <limits>
+#include <cmath>
+#include <random>
+#include <cstring> // For memcpy
+#include <cerrno>
+#include <csignal>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the AVX2 kernels
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sched.h> // For sched_setaffinity()
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include <fcntl.h>  // For open()
+#include <unistd.h> // For write(), fdatasync(), ftruncate()
+#include <sys/mman.h> // For shm_open(), mmap()
+#include <sys/stat.h> // For fstat()
 
+// Element types, used wherever elements are kept as plain data
+enum class ElementType : unsigned char { Point, Line, Rectangle };
+
+// Elements of a Drawing's unique pointer collection are referred to by index
+using ElementHandle = std::size_t;
+
+// Plain-data copy of an element: its type, layer and up to four coordinates
+struct ElementRecord{
+  ElementType  type;
+  std::int16_t layer;
+  int v[4];
+};
+
+// Type of the record standing in for a removed element (a hole)
+constexpr ElementType removed_element = static_cast<ElementType>(0xFF);
 
 // Base abstract type class
 class DrawingElement{
 public:
+  // Tag of classes outside the built-in ElementTypes
+  static constexpr unsigned char extension_tag = 0xFF;
+
   DrawingElement(){}
-  ~DrawingElement(){}
+  virtual ~DrawingElement(){}
+
+  // Elements are allocated from the current ElementArena, if any,
+  // and from the heap otherwise (see "Element pool" below).
+  // Over-aligned classes always come from the heap.
+  static void* operator new(std::size_t size);
+  static void operator delete(void* ptr);
+  static void* operator new(std::size_t size, std::align_val_t alignment){
+    return ::operator new(size, alignment);
+  }
+  static void operator delete(void* ptr, std::align_val_t alignment){
+    ::operator delete(ptr, alignment);
+  }
+
+  // One-byte type tag: the ElementType of the built-in (final) classes,
+  // so loops can call their render() without going through the vtable
+  unsigned char tag() const{ return _tag; }
 
   // All inherited classes must implement render()
   virtual void render()=0;
+
+  // ...and be able to describe themselves as plain data
+  virtual ElementRecord record() const =0;
+
+  // Layer (z-order); higher layers are rendered on top
+  std::int16_t layer() const{ return _layer; }
+  void set_layer(std::int16_t layer){ _layer = layer; }
+
+protected:
+  explicit DrawingElement(ElementType type): _tag(static_cast<unsigned char>(type)){}
+
+private:
+  std::int16_t  _layer{0};
+  unsigned char _tag{extension_tag};
 };
 
 // Point
-class Point: public DrawingElement{
+class Point final: public DrawingElement{
 public:
-  Point(int x, int y): _x(x), _y(y){}
+  static constexpr ElementType element_type = ElementType::Point;
+
+  Point(int x, int y): DrawingElement(ElementType::Point), _x(x), _y(y){}
 
   ~Point(){}
 
   void render() override{
     std::cout << "Rendering a point (" << _x << ", " << _y << ")" << std::endl;
   }
+
+  ElementRecord record() const override{
+    return {ElementType::Point, layer(), {_x, _y, 0, 0}};
+  }
+
+  int x() const{ return _x; }
+  int y() const{ return _y; }
+  void set_x(int x){ _x = x; }
+  void set_y(int y){ _y = y; }
   
 private:
   int _x, _y;
 };
 
 // Line
-class Line: public DrawingElement{
+class Line final: public DrawingElement{
 public:
+  static constexpr ElementType element_type = ElementType::Line;
+
   Line(int x1, int y1, int x2, int y2): 
+    DrawingElement(ElementType::Line),
     _x1(x1), _y1(y1), 
     _x2(x2), _y2(y2){}
 
@@ -49,14 +152,28 @@ public:
     std::cout << "Rendering a line from (" << _x1 << ", " << _y1
               << ") to (" << _x2 << ", " << _y2 << ")" << std::endl;
   }
+
+  ElementRecord record() const override{
+    return {ElementType::Line, layer(), {_x1, _y1, _x2, _y2}};
+  }
+
+  int x1() const{ return _x1; }
+  int y1() const{ return _y1; }
+  int x2() const{ return _x2; }
+  int y2() const{ return _y2; }
+  void set_start(int x1, int y1){ _x1 = x1; _y1 = y1; }
+  void set_end(int x2, int y2){ _x2 = x2; _y2 = y2; }
 private:
   int _x1, _y1, _x2, _y2;
 };
 
 // Rectangle
-class Rectangle: public DrawingElement{
+class Rectangle final: public DrawingElement{
 public:
+  static constexpr ElementType element_type = ElementType::Rectangle;
+
   Rectangle(int x, int y, int w, int h): 
+    DrawingElement(ElementType::Rectangle),
     _x(x), _y(y),
     _w(w), _h(h){}
 
@@ -67,202 +184,6716 @@ public:
     std::cout << "Rendering a rectangle of dimension " << _w << "x" << _h
               << ", from (" << _x << ", " << _y << ")" << std::endl;
   }
+
+  ElementRecord record() const override{
+    return {ElementType::Rectangle, layer(), {_x, _y, _w, _h}};
+  }
+
+  int x() const{ return _x; }
+  int y() const{ return _y; }
+  int w() const{ return _w; }
+  int h() const{ return _h; }
+  void set_position(int x, int y){ _x = x; _y = y; }
+  void set_size(int w, int h){ _w = w; _h = h; }
 private:
   int _x, _y, _w, _h;
 };
 
-// Drawing, which contains a collection of elements
-// representing small parts that make up a single drawing
-class Drawing{
+// --------------------------------------------------
+// Element pool
+//
+// An ElementPool hands out 64 KiB blocks and can be shared by
+// many drawings: process-wide (ElementPool::global()) or one per
+// tenant. Each drawing allocates its elements through its own
+// ElementArena, which cuts the blocks into 64-byte slots, keeps
+// count of what it uses, and hands all its blocks back in one go
+// when the drawing is destroyed.
+//
+// Every element is preceded by the arena it came from (null for
+// heap elements), so delete knows where to return it. Elements
+// must not outlive the drawing whose arena they came from.
+// --------------------------------------------------
+
+class ElementPool{
 public:
-  Drawing(){}
-  ~Drawing(){
-    clear_drawing_ptrs();
+  static constexpr std::size_t block_size = 64 * 1024;
+
+  ElementPool(){}
+
+  ~ElementPool(){
+    trim();
   }
 
-  // --------------------------------------------------
-  /* !! This will throw a compilation error: 
-     
-     "cannot declare parameter 'element' to be of
-      abstract type 'DrawingElement'"
-  */
+  ElementPool(const ElementPool&) = delete;
+  ElementPool& operator=(const ElementPool&) = delete;
 
-  // Add drawing element to collection
-  // void add_element(DrawingElement element){
-  //   _drawing.push_back(element);
-  // }
-  // --------------------------------------------------
+  static ElementPool& global(){
+    static ElementPool pool;
+    return pool;
+  }
 
-  // Add drawing element pointer to collection
-  void add_element_ptr(DrawingElement* element_ptr){
-    _drawing_ptrs.push_back(element_ptr);
+  void* acquire_block(){
+    std::lock_guard<std::mutex> lock{_mutex};
+    ++_blocks_in_use;
+    if(!_free_blocks.empty()){
+      void* block = _free_blocks.back();
+      _free_blocks.pop_back();
+      return block;
+    }
+    return ::operator new(block_size);
   }
 
-  // Add drawing element unique pointer to collection
-  void add_element_u_ptr(std::unique_ptr<DrawingElement> element_u_ptr){
+  // Take back many blocks under a single lock
+  void release_blocks(const std::vector<void*>& blocks){
+    std::lock_guard<std::mutex> lock{_mutex};
+    _free_blocks.insert(_free_blocks.end(), blocks.begin(), blocks.end());
+    _blocks_in_use -= blocks.size();
+  }
 
-    // This will not work, because vector tries
-    // to *copy* a unique pointer.
-    // _drawing_u_ptrs.emplace_back(elementUPtr);
+  // Return unused blocks to the system
+  void trim(){
+    std::lock_guard<std::mutex> lock{_mutex};
+    for(void* block: _free_blocks){
+      ::operator delete(block);
+    }
+    _free_blocks.clear();
+  }
 
-    // Unique pointers must be moved
-    _drawing_u_ptrs.emplace_back(std::move(element_u_ptr));
+  std::size_t blocks_in_use() const{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _blocks_in_use;
   }
-  
-  // --------------------------------------------------
-  // This throws a compilation error
-  //
-  // Rendering from collection of DrawingElement objects
-  // void render(){
-  //   for(auto element: _drawing){
-  //     element.render();
-  //   }
-  // }
-  // --------------------------------------------------
 
-  // Rendering from collection of pointers to DrawingElement
-  void render_ptrs(){
-    std::cout << std::endl;
+  std::size_t blocks_free() const{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _free_blocks.size();
+  }
 
-    if(_drawing_ptrs.empty()){
-      std::cout << "Collection of pointers is empty" << std::endl;
-      return;
+private:
+  mutable std::mutex _mutex;
+  std::vector<void*> _free_blocks;
+  std::size_t _blocks_in_use{0};
+};
+
+class ElementArena{
+public:
+  static constexpr std::size_t slot_size   = 64;
+  // The arena pointer, padded so the element after it is aligned
+  // as well as anything from ::operator new
+  static constexpr std::size_t header_size = alignof(std::max_align_t);
+  static constexpr std::size_t max_element_size = slot_size - header_size;
+
+  struct Stats{
+    std::size_t live_elements;
+    std::size_t blocks;
+    std::size_t bytes_reserved;
+  };
+
+  explicit ElementArena(ElementPool& pool): _pool(pool){}
+
+  // Everything goes back to the pool at once
+  ~ElementArena(){
+    _pool.release_blocks(_blocks);
+  }
+
+  ElementArena(const ElementArena&) = delete;
+  ElementArena& operator=(const ElementArena&) = delete;
+
+  // A slot of `slot_size` bytes; reuses freed slots first
+  void* allocate(){
+    std::lock_guard<std::mutex> lock{_mutex};
+    ++_live;
+    if(_free_slots != nullptr){
+      FreeSlot* slot = _free_slots;
+      _free_slots = slot->next;
+      return slot;
     }
-    
-    std::cout << "Rendering " << _drawing_ptrs.size() << " elements from pointers" << std::endl;
-    for(auto element_ptr: _drawing_ptrs){
-      if(element_ptr == nullptr){
-        std::cout << "  ** Null pointer" << std::endl;
-      } else{
-        element_ptr->render();
-      }
+    if(_next == _end){
+      start_block(_pool.acquire_block());
     }
+    void* slot = _next;
+    _next += slot_size;
+    return slot;
   }
 
-  // Rendering from collection of unique pointers to DrawingElement
-  void render_u_ptrs(){
-    std::cout << std::endl;
-    std::cout << "Rendering " << _drawing_u_ptrs.size() << " elements from unique pointers" << std::endl;
+  void free(void* slot){
+    std::lock_guard<std::mutex> lock{_mutex};
+    --_live;
+    _free_slots = new(slot) FreeSlot{_free_slots};
+  }
 
-    // Must dereference to be used
-    for(auto& elementPtr: _drawing_u_ptrs){
-      elementPtr->render();
-    }
+  Stats stats() const{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return {_live, _blocks.size(), _blocks.size() * ElementPool::block_size};
   }
-  
-  // Factory Methods ------------------------------
-  
-  static std::unique_ptr<Point> getPointPtr(int x, int y){
-    return std::unique_ptr<Point>{new Point{x, y}};
+
+  ElementPool& pool() const{
+    return _pool;
   }
-  
-  static std::unique_ptr<Line> getLinePtr(int x1, int y1, int x2, int y2){
-    return std::unique_ptr<Line>{new Line{x1, y1, x2, y2}};
+
+  // Arena used by `new` for elements on this thread, if any
+  static ElementArena*& current(){
+    thread_local ElementArena* arena = nullptr;
+    return arena;
   }
-  
-  static std::unique_ptr<Rectangle> getRectanglePtr(int x, int y, int w, int h){
-    return std::unique_ptr<Rectangle>{new Rectangle{x, y, w, h}};
+
+private:
+  struct FreeSlot{
+    FreeSlot* next;
+  };
+
+  void start_block(void* block){
+    _blocks.push_back(block);
+    _next = static_cast<char*>(block);
+    _end  = _next + ElementPool::block_size / slot_size * slot_size;
   }
 
-  // -----------------------------------------------
+  ElementPool& _pool;
+  mutable std::mutex _mutex;
+  std::vector<void*> _blocks;
+  char* _next{nullptr};
+  char* _end{nullptr};
+  FreeSlot* _free_slots{nullptr};
+  std::size_t _live{0};
+};
 
-  // Draw some basic elements
-  void draw(){
-    _drawing.clear();
+// Makes `arena` the current one on this thread for its lifetime;
+// a null arena means the heap
+class ArenaScope{
+public:
+  explicit ArenaScope(ElementArena* arena):
+    _previous(ElementArena::current()){
+    ElementArena::current() = arena;
+  }
+  ~ArenaScope(){
+    ElementArena::current() = _previous;
+  }
+  ArenaScope(const ArenaScope&) = delete;
+  ArenaScope& operator=(const ArenaScope&) = delete;
+private:
+  ElementArena* _previous;
+};
 
-    /* 
-       The following will give compilation error:
+inline void* DrawingElement::operator new(std::size_t size){
+  ElementArena* arena = ElementArena::current();
+  char* memory;
+  if(arena != nullptr && size <= ElementArena::max_element_size){
+    memory = static_cast<char*>(arena->allocate());
+  } else{
+    memory = static_cast<char*>(::operator new(size + ElementArena::header_size));
+    arena  = nullptr;
+  }
+  *reinterpret_cast<ElementArena**>(memory) = arena;
+  return memory + ElementArena::header_size;
+}
 
-         "invalid new-expression of abstract class type 'DrawingElement'"
-    */
-    // _drawing.push_back(Point{10, 15});
-    // _drawing.push_back(Line{25, 25, 50, 100});
-    // _drawing.push_back(Rectangle{50, 50, 100, 75}); 
-    // --------------------------------------------------
+inline void DrawingElement::operator delete(void* ptr){
+  if(ptr == nullptr){
+    return;
+  }
+  char* memory = static_cast<char*>(ptr) - ElementArena::header_size;
+  ElementArena* arena = *reinterpret_cast<ElementArena**>(memory);
+  if(arena != nullptr){
+    arena->free(memory);
+  } else{
+    ::operator delete(memory);
+  }
+}
 
-    // We can create individual elements
-    Point      point{10, 15};
-    Line       line{25, 25, 50, 100};
-    Rectangle  rect{50, 50, 100, 75};
+// Plain-data copy of an element, with a direct call for the built-in types
+inline ElementRecord record_of(const DrawingElement& element){
+  switch(element.tag()){
+  case static_cast<unsigned char>(ElementType::Point):     return static_cast<const Point&>(element).record();
+  case static_cast<unsigned char>(ElementType::Line):      return static_cast<const Line&>(element).record();
+  case static_cast<unsigned char>(ElementType::Rectangle): return static_cast<const Rectangle&>(element).record();
+  default:                                                 return element.record();
+  }
+}
 
-    /*
-       But we can't insert them to the vector:
+// Recreate an element from its plain-data copy
+std::unique_ptr<DrawingElement> make_element(const ElementRecord& record){
+  const int* v = record.v;
+  std::unique_ptr<DrawingElement> element;
+  switch(record.type){
+  case ElementType::Point:     element.reset(new Point{v[0], v[1]}); break;
+  case ElementType::Line:      element.reset(new Line{v[0], v[1], v[2], v[3]}); break;
+  case ElementType::Rectangle: element.reset(new Rectangle{v[0], v[1], v[2], v[3]}); break;
+  }
+  if(element){
+    element->set_layer(record.layer);
+  }
+  return element;
+}
 
-         "invalid new-expression of abstract class type 'DrawingElement'"
-    */
-    // _drawing.push_back(point);
-    // _drawing.push_back(line);
-    // _drawing.push_back(rect);
-    // --------------------------------------------------
+// Render an element from its plain-data copy, through a temporary
+// on the stack so nothing is allocated
+inline void render_record(const ElementRecord& record){
+  const int* v = record.v;
+  switch(record.type){
+  case ElementType::Point:     Point{v[0], v[1]}.render(); break;
+  case ElementType::Line:      Line{v[0], v[1], v[2], v[3]}.render(); break;
+  case ElementType::Rectangle: Rectangle{v[0], v[1], v[2], v[3]}.render(); break;
   }
+}
 
-  void draw_ptrs(){
-    _drawing_ptrs.clear();
+// Render an element, with a direct call for the built-in types
+inline void render_element(DrawingElement& element){
+  switch(element.tag()){
+  case static_cast<unsigned char>(ElementType::Point):     static_cast<Point&>(element).render(); break;
+  case static_cast<unsigned char>(ElementType::Line):      static_cast<Line&>(element).render(); break;
+  case static_cast<unsigned char>(ElementType::Rectangle): static_cast<Rectangle&>(element).render(); break;
+  default:                                                 element.render(); break;
+  }
+}
 
-    Point      point{10, 15};
-    Line       line{25, 25, 50, 100};
-    Rectangle  rect{50, 50, 100, 75};
+// Move a built-in element by (dx, dy); other classes are left as they are
+inline void translate_element(DrawingElement& element, int dx, int dy){
+  switch(element.tag()){
+  case static_cast<unsigned char>(ElementType::Point):{
+    Point& point = static_cast<Point&>(element);
+    point.set_x(point.x() + dx);
+    point.set_y(point.y() + dy);
+    break;
+  }
+  case static_cast<unsigned char>(ElementType::Line):{
+    Line& line = static_cast<Line&>(element);
+    line.set_start(line.x1() + dx, line.y1() + dy);
+    line.set_end(line.x2() + dx, line.y2() + dy);
+    break;
+  }
+  case static_cast<unsigned char>(ElementType::Rectangle):{
+    Rectangle& rect = static_cast<Rectangle&>(element);
+    rect.set_position(rect.x() + dx, rect.y() + dy);
+    break;
+  }
+  default:
+    break;
+  }
+}
 
-    // Adding pointers work, but as soon as we leave this scope
-    // the objects are destroyed. Calling render() from where
-    // draw_ptrs() was called will throw an exception at runtime:
-    //    "pure virtual method called"
-    // _drawing_ptrs.push_back(&point);
-    // _drawing_ptrs.push_back(&line);
-    // _drawing_ptrs.push_back(&rect);
-    // --------------------------------------------------
+// --------------------------------------------------
+// Tracing
+//
+// TRACE_SCOPE("name") records how long the enclosing scope took,
+// into a ring buffer owned by the calling thread, so recording
+// takes no locks. Tracer::write_chrome_json() dumps all buffers
+// in the Chrome trace format, for Perfetto or about:tracing.
+//
+// Tracing is off until Tracer::enable(); until then a scope costs
+// one relaxed load and a branch that is always predicted right.
+// Build with -DPTR_NOTES_NO_TRACING to compile it out entirely.
+// --------------------------------------------------
 
-    // We can use the `new` keyword, but we must remember
-    // to clear the allocated memory.
-    _drawing_ptrs.push_back(new Point{45, 55});
-    _drawing_ptrs.push_back(new Line{88, 98, 456, 987});
-    _drawing_ptrs.push_back(new Rectangle{879, 654, 123, 321});
+struct TraceEvent{
+  const char*   name;
+  std::uint64_t start_ns;
+  std::uint64_t duration_ns;
+};
+
+// Written by its own thread only; once full, the oldest events
+// are overwritten
+class TraceBuffer{
+public:
+  static constexpr std::size_t capacity = 1 << 14;
+
+  explicit TraceBuffer(std::uint32_t thread_id):
+    _thread_id(thread_id), _events(capacity){}
+
+  void push(const TraceEvent& event){
+    std::uint64_t head = _head.load(std::memory_order_relaxed);
+    _events[head % capacity] = event;
+    _head.store(head + 1, std::memory_order_release);
   }
 
-  // Clear pointers created with `new` keyword
-  void clear_drawing_ptrs(){
-    std::cout << std::endl;
-    std::cout << "* Deleting pointers" << std::endl;
-    for(auto ptr: _drawing_ptrs){
-      delete ptr;
+  // Calls f(event) for every retained event, oldest first. Events
+  // written while this runs may come out torn; dump when quiet.
+  template<typename F>
+  void for_each(F&& f) const{
+    std::uint64_t head = _head.load(std::memory_order_acquire);
+    std::uint64_t first = head > capacity ? head - capacity : 0;
+    for(std::uint64_t i = first; i < head; ++i){
+      f(_events[i % capacity]);
     }
-    _drawing_ptrs.clear();
   }
 
-  void draw_u_ptrs(){
-    _drawing_u_ptrs.clear();
-    // directly pushing back to vector
-    _drawing_u_ptrs.push_back(std::make_unique<Point>(180, 185));
+  std::uint32_t thread_id() const{ return _thread_id; }
 
-    // allegedly, emplace_back assures that the pointer is moved, and not copied
-    _drawing_u_ptrs.emplace_back(std::make_unique<Point>(10, 15));
-    _drawing_u_ptrs.emplace_back(getPointPtr(35, 22));
+private:
+  std::uint32_t _thread_id;
+  std::vector<TraceEvent> _events;
+  std::atomic<std::uint64_t> _head{0};
+};
 
-    // Method call which uses std::move()
-    add_element_u_ptr(std::make_unique<Point>(1, 5));
-    add_element_u_ptr(std::make_unique<Line>(2, 3, 724, 1125));
-    add_element_u_ptr(std::make_unique<Rectangle>(2225, 4523, 1124, 1125));
+class Tracer{
+public:
+  static void enable(bool enabled = true){
+    flag().store(enabled, std::memory_order_relaxed);
+  }
+
+  static bool enabled(){
+    return flag().load(std::memory_order_relaxed);
+  }
+
+  static std::uint64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // The calling thread's buffer; taking it is the only locked step.
+  // When the thread exits the buffer goes back to the registry for
+  // the next new thread, so there are only as many buffers as there
+  // were threads alive at once. Old events stay until overwritten.
+  static TraceBuffer& thread_buffer(){
+    thread_local BufferLease lease;
+    if(lease.buffer == nullptr){
+      Registry& registry = Tracer::registry();
+      std::lock_guard<std::mutex> lock{registry.mutex};
+      if(!registry.free_buffers.empty()){
+        lease.buffer = registry.free_buffers.back();
+        registry.free_buffers.pop_back();
+      } else{
+        registry.buffers.emplace_back(new TraceBuffer{std::uint32_t(registry.buffers.size() + 1)});
+        lease.buffer = registry.buffers.back().get();
+      }
+    }
+    return *lease.buffer;
+  }
+
+  // Complete ("X") events, timestamps in microseconds
+  static void write_chrome_json(std::ostream& out){
+    Registry& registry = Tracer::registry();
+    std::lock_guard<std::mutex> lock{registry.mutex};
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for(auto& buffer: registry.buffers){
+      buffer->for_each([&](const TraceEvent& event){
+        out << (first ? "\n" : ",\n")
+            << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id()
+            << ",\"ts\":" << event.start_ns / 1000 << "." << std::setw(3) << std::setfill('0') << event.start_ns % 1000
+            << ",\"dur\":" << event.duration_ns / 1000 << "." << std::setw(3) << std::setfill('0') << event.duration_ns % 1000
+            << "}";
+        first = false;
+      });
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
   }
 
 private:
+  struct Registry{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers; // Kept, so events outlive their threads
+    std::vector<TraceBuffer*> free_buffers;            // Left by threads that have exited
+  };
 
-  // Collection of drawing elements
-  std::vector<DrawingElement> _drawing;
+  // Returns the thread's buffer to the registry on thread exit
+  struct BufferLease{
+    TraceBuffer* buffer{nullptr};
+    ~BufferLease(){
+      if(buffer != nullptr){
+        Registry& registry = Tracer::registry();
+        std::lock_guard<std::mutex> lock{registry.mutex};
+        registry.free_buffers.push_back(buffer);
+      }
+    }
+  };
 
-  // Collection of pointers to drawing elements
-  std::vector<DrawingElement*> _drawing_ptrs;
+  static Registry& registry(){
+    static Registry registry;
+    return registry;
+  }
 
-  // Collection of unique pointers to drawing elements
-  std::vector<std::unique_ptr<DrawingElement>> _drawing_u_ptrs;
+  static std::atomic<bool>& flag(){
+    static std::atomic<bool> enabled{false};
+    return enabled;
+  }
+};
+
+class TraceScope{
+public:
+  explicit TraceScope(const char* name){
+    if(Tracer::enabled()){
+      _name  = name;
+      _start = Tracer::now_ns();
+    }
+  }
+
+  ~TraceScope(){
+    if(_name != nullptr){
+      Tracer::thread_buffer().push({_name, _start, Tracer::now_ns() - _start});
+    }
+  }
 
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+  const char*   _name{nullptr};
+  std::uint64_t _start{0};
 };
 
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#ifdef PTR_NOTES_NO_TRACING
+#define TRACE_SCOPE(name) do{}while(false)
+#else
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__){name}
+#endif
+
 // --------------------------------------------------
-// --------------------------------------------------
+// Hardware counters
+//
+// Optional perf_event_open counters around a measured region.
+// Each event is opened on its own so that a PMU which can't
+// count them all at once still reports the rest; counts are
+// scaled if the kernel had to multiplex them.
 // --------------------------------------------------
 
-int main(int argc, char* argv[])
-{
+class PerfCounters{
+public:
+  PerfCounters(){
+#ifdef __linux__
+    for(const Event& event: events()){
+      perf_event_attr attr{};
+      attr.size           = sizeof(attr);
+      attr.type           = event.type;
+      attr.config         = event.config;
+      attr.disabled       = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      _fds.push_back(int(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)));
+    }
+#endif
+    _counts.assign(_fds.size(), 0);
+  }
+
+  ~PerfCounters(){
+    for(int fd: _fds){
+      if(fd >= 0){
+        ::close(fd);
+      }
+    }
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool available() const{
+    return std::any_of(_fds.begin(), _fds.end(), [](int fd){ return fd >= 0; });
+  }
+
+  void start(){
+#ifdef __linux__
+    for(int fd: _fds){
+      if(fd >= 0){
+        ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  void stop(){
+#ifdef __linux__
+    for(std::size_t i = 0; i < _fds.size(); ++i){
+      if(_fds[i] < 0){
+        continue;
+      }
+      ::ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      std::uint64_t values[3] = {0, 0, 0}; // Count, time enabled, time running
+      if(::read(_fds[i], values, sizeof(values)) == sizeof(values) && values[2] > 0){
+        _counts[i] = std::uint64_t(double(values[0]) * double(values[1]) / double(values[2]));
+      } else{
+        _counts[i] = 0;
+      }
+    }
+#endif
+  }
+
+  // Last count of event `name` (e.g. "LLC misses"), or -1 if it
+  // couldn't be counted
+  double count(const std::string& name) const{
+    std::vector<Event> list = events();
+    for(std::size_t i = 0; i < list.size() && i < _fds.size(); ++i){
+      if(name == list[i].name && _fds[i] >= 0){
+        return double(_counts[i]);
+      }
+    }
+    return -1;
+  }
+
+  // Print each counter divided by `elements`
+  void report(std::ostream& out, std::size_t elements) const{
+    std::size_t i = 0;
+    for(const Event& event: events()){
+      out << "    " << event.name << ": ";
+      if(i < _fds.size() && _fds[i] >= 0){
+        out << double(_counts[i]) / double(std::max<std::size_t>(1, elements)) << " per element";
+      } else{
+        out << "n/a";
+      }
+      out << std::endl;
+      ++i;
+    }
+  }
+
+private:
+  struct Event{
+    const char* name;
+    std::uint32_t type;
+    std::uint64_t config;
+  };
+
+  static std::vector<Event> events(){
+#ifdef __linux__
+    auto cache = [](std::uint64_t cache, std::uint64_t op, std::uint64_t result){
+      return cache | (op << 8) | (result << 16);
+    };
+    return {
+      {"cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {"L1d misses",    PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D,  PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {"LLC misses",    PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL,   PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {"dTLB misses",   PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    };
+#else
+    return {};
+#endif
+  }
+
+  std::vector<int> _fds;
+  std::vector<std::uint64_t> _counts;
+};
+
+// --------------------------------------------------
+// Prefetching
+//
+// Loops over pointers to elements miss the cache on every element
+// that isn't laid out in order. They can ask for element i + distance
+// while working on element i. Its vtable isn't prefetched: finding it
+// means reading the vtable pointer, a demand load on the very line
+// being prefetched, and the few vtables stay in cache regardless.
+// Drawing picks the distance by timing a few.
+// --------------------------------------------------
+
+// Stream buffer that drops everything written to it
+class NullBuffer: public std::streambuf{
+protected:
+  int overflow(int c) override{ return c; }
+  std::streamsize xsputn(const char*, std::streamsize n) override{ return n; }
+};
+
+// Sends std::cout to `buffer` until it goes out of scope, even by a throw
+class CoutRedirect{
+public:
+  explicit CoutRedirect(std::streambuf* buffer): _console(std::cout.rdbuf(buffer)){}
+  ~CoutRedirect(){ std::cout.rdbuf(_console); }
+  CoutRedirect(const CoutRedirect&) = delete;
+  CoutRedirect& operator=(const CoutRedirect&) = delete;
+
+private:
+  std::streambuf* _console;
+};
+
+inline DrawingElement* element_address(DrawingElement* element){
+  return element;
+}
+
+inline DrawingElement* element_address(const std::unique_ptr<DrawingElement>& element){
+  return element.get();
+}
+
+// Prefetch for iteration `i` of a loop over `elements`; null entries are skipped
+template<typename Pointer>
+inline void prefetch_ahead(const std::vector<Pointer>& elements, std::size_t i, std::size_t distance){
+  if(distance == 0){
+    return;
+  }
+  // Only the object: reading its vtable pointer here would be a
+  // demand load, stalling on the very miss being prefetched. The
+  // few vtables stay in cache anyway.
+  if(i + distance < elements.size()){
+    __builtin_prefetch(element_address(elements[i + distance]));
+  }
+}
+
+// --------------------------------------------------
+// Parallel helpers
+// --------------------------------------------------
+
+// Number of workers to use for `n` items, at least `min_chunk` items each
+inline std::size_t worker_count(std::size_t n, std::size_t min_chunk){
+  std::size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  return std::max<std::size_t>(1, std::min(hardware, n / std::max<std::size_t>(1, min_chunk)));
+}
+
+// Split [0, n) into one contiguous range per worker and run
+// body(worker, begin, end) on each; the calling thread takes part
+template<typename Body>
+void parallel_for(std::size_t n, Body&& body, std::size_t min_chunk = 1 << 14){
+  std::size_t workers = worker_count(n, min_chunk);
+  if(workers == 1){
+    body(std::size_t{0}, std::size_t{0}, n);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for(std::size_t w = 1; w < workers; ++w){
+    threads.emplace_back([&, w]{
+      TRACE_SCOPE("parallel_for worker");
+      body(w, n * w / workers, n * (w + 1) / workers);
+    });
+  }
+  {
+    TRACE_SCOPE("parallel_for worker");
+    body(std::size_t{0}, std::size_t{0}, n / workers);
+  }
+  for(auto& thread: threads){
+    thread.join();
+  }
+}
+
+// Stable LSD radix sort of 64-bit keys, one byte per pass, over
+// bytes [first_byte, last_byte]. Passes where every key has the
+// same byte are skipped. Each pass histograms and scatters in
+// parallel; per-worker offsets keep the sort stable.
+inline void parallel_radix_sort(std::vector<std::uint64_t>& keys, int first_byte, int last_byte){
+  std::size_t n = keys.size();
+  std::size_t workers = worker_count(n, 1 << 14);
+  std::vector<std::uint64_t> buffer(n);
+  std::vector<std::size_t> counts(workers * 256);
+
+  for(int byte = first_byte; byte <= last_byte; ++byte){
+    int shift = byte * 8;
+    std::fill(counts.begin(), counts.end(), 0);
+    parallel_for(n, [&](std::size_t w, std::size_t begin, std::size_t end){
+      std::size_t* count = &counts[w * 256];
+      for(std::size_t i = begin; i < end; ++i){
+        ++count[(keys[i] >> shift) & 0xFF];
+      }
+    });
+
+    // Bucket-major, worker-minor prefix sum
+    std::size_t offset = 0;
+    bool constant = false;
+    for(std::size_t bucket = 0; bucket < 256; ++bucket){
+      std::size_t bucket_total = 0;
+      for(std::size_t w = 0; w < workers; ++w){
+        std::size_t count = counts[w * 256 + bucket];
+        counts[w * 256 + bucket] = offset;
+        offset += count;
+        bucket_total += count;
+      }
+      constant = constant || bucket_total == n;
+    }
+    if(constant){
+      continue;
+    }
+
+    parallel_for(n, [&](std::size_t w, std::size_t begin, std::size_t end){
+      std::size_t* next = &counts[w * 256];
+      for(std::size_t i = begin; i < end; ++i){
+        buffer[next[(keys[i] >> shift) & 0xFF]++] = keys[i];
+      }
+    });
+    keys.swap(buffer);
+  }
+}
+
+
+// --------------------------------------------------
+// NUMA
+//
+// Nodes and their CPUs, read from /sys/devices/system/node. With
+// one node, or without that directory, the machine is treated as
+// a single node holding every CPU and threads are never pinned.
+// --------------------------------------------------
+
+class NumaTopology{
+public:
+  static const NumaTopology& get(){
+    static NumaTopology topology;
+    return topology;
+  }
+
+  std::size_t nodes() const{
+    return _cpus.size();
+  }
+
+  const std::vector<int>& cpus(std::size_t node) const{
+    return _cpus[node];
+  }
+
+  // One pool per node, so a block is only ever reused on the node
+  // whose threads first touched it
+  ElementPool& pool(std::size_t node) const{
+    return *_pools[node];
+  }
+
+  // Keep the calling thread on the CPUs of `node`
+  void pin(std::size_t node) const{
+#ifdef __linux__
+    if(nodes() == 1){
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu: _cpus[node]){
+      CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set); // Best effort
+#else
+    (void)node;
+#endif
+  }
+
+  // "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+  static std::vector<int> parse_list(const std::string& list){
+    std::vector<int> values;
+    std::size_t pos = 0;
+    while(pos < list.size()){
+      std::size_t end = list.find(',', pos);
+      std::string item = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+      std::size_t dash = item.find('-');
+      try{
+        int first = std::stoi(item.substr(0, dash));
+        int last  = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for(int value = first; value <= last; ++value){
+          values.push_back(value);
+        }
+      } catch(const std::exception&){
+        // Blank or malformed item
+      }
+      if(end == std::string::npos){
+        break;
+      }
+      pos = end + 1;
+    }
+    return values;
+  }
+
+private:
+  NumaTopology(){
+    const std::string root = "/sys/devices/system/node/";
+    std::string online;
+    std::ifstream{root + "online"} >> online;
+    for(int node: parse_list(online)){
+      std::string cpus;
+      std::ifstream{root + "node" + std::to_string(node) + "/cpulist"} >> cpus;
+      std::vector<int> list = parse_list(cpus);
+      if(!list.empty()){ // Memory-only nodes have no CPUs to run on
+        _cpus.push_back(std::move(list));
+      }
+    }
+    if(_cpus.size() < 2){
+      _cpus.assign(1, {});
+      for(unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu){
+        _cpus[0].push_back(int(cpu));
+      }
+    }
+    for(std::size_t node = 0; node < _cpus.size(); ++node){
+      _pools.emplace_back(new ElementPool);
+    }
+  }
+
+  std::vector<std::vector<int>> _cpus;
+  std::vector<std::unique_ptr<ElementPool>> _pools;
+};
+
+// Run body(node, begin, end) over [ranges[node], ranges[node + 1])
+// for every node, split among threads pinned to that node. On a
+// single node this is parallel_for().
+template<typename Body>
+void numa_parallel_for(const std::vector<std::size_t>& ranges, Body&& body, std::size_t min_chunk = 1 << 14){
+  const NumaTopology& topology = NumaTopology::get();
+  if(ranges.size() == 2){
+    std::size_t first = ranges[0];
+    parallel_for(ranges[1] - first, [&](std::size_t, std::size_t begin, std::size_t end){
+      body(std::size_t{0}, first + begin, first + end);
+    }, min_chunk);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for(std::size_t node = 0; node + 1 < ranges.size(); ++node){
+    std::size_t first = ranges[node];
+    std::size_t n = ranges[node + 1] - first;
+    std::size_t workers = std::max<std::size_t>(1, std::min(topology.cpus(node).size(), n / std::max<std::size_t>(1, min_chunk)));
+    for(std::size_t w = 0; n > 0 && w < workers; ++w){
+      threads.emplace_back([&, node, first, n, w, workers]{
+        topology.pin(node);
+        TRACE_SCOPE("numa_parallel_for worker");
+        body(node, first + n * w / workers, first + n * (w + 1) / workers);
+      });
+    }
+  }
+  for(auto& thread: threads){
+    thread.join();
+  }
+}
+
+// --------------------------------------------------
+// Geometry
+//
+// Exact predicates on the integer coordinates of ElementRecords.
+// Coordinate differences need 33 bits and their products 66, so
+// cross products are computed in 128-bit integers.
+// --------------------------------------------------
+
+using wide_int = __int128;
+
+// Axis-aligned bounding box; 64-bit since x + w may overflow an int
+struct Bounds{
+  long long min_x, min_y, max_x, max_y;
+};
+
+inline Bounds bounds(const ElementRecord& record){
+  const int* v = record.v;
+  switch(record.type){
+  case ElementType::Point:
+    return {v[0], v[1], v[0], v[1]};
+  case ElementType::Line:
+    return {std::min(v[0], v[2]), std::min(v[1], v[3]),
+            std::max(v[0], v[2]), std::max(v[1], v[3])};
+  case ElementType::Rectangle:
+    // Rectangles cover [x, x + w] x [y, y + h], either sign of w, h
+    return {std::min<long long>(v[0], (long long)v[0] + v[2]), std::min<long long>(v[1], (long long)v[1] + v[3]),
+            std::max<long long>(v[0], (long long)v[0] + v[2]), std::max<long long>(v[1], (long long)v[1] + v[3])};
+  }
+  return {0, 0, 0, 0};
+}
+
+inline bool boxes_overlap(const Bounds& a, const Bounds& b){
+  return a.min_x <= b.max_x && b.min_x <= a.max_x
+      && a.min_y <= b.max_y && b.min_y <= a.max_y;
+}
+
+// Sign of the cross product (b - a) x (c - a): 1 left turn, -1 right turn, 0 collinear
+inline int orientation(long long ax, long long ay, long long bx, long long by, long long cx, long long cy){
+  wide_int cross = wide_int(bx - ax) * (cy - ay) - wide_int(by - ay) * (cx - ax);
+  return (cross > 0) - (cross < 0);
+}
+
+// Do segments (a1, a2) and (b1, b2) share at least one point?
+inline bool segments_intersect(const int* a, const int* b){
+  int o1 = orientation(a[0], a[1], a[2], a[3], b[0], b[1]);
+  int o2 = orientation(a[0], a[1], a[2], a[3], b[2], b[3]);
+  int o3 = orientation(b[0], b[1], b[2], b[3], a[0], a[1]);
+  int o4 = orientation(b[0], b[1], b[2], b[3], a[2], a[3]);
+  if(o1 * o2 > 0 || o3 * o4 > 0){
+    return false;
+  }
+  if(o1 == 0 && o2 == 0){
+    // Collinear: the segments meet if their boxes do
+    ElementRecord ra{ElementType::Line, 0, {a[0], a[1], a[2], a[3]}};
+    ElementRecord rb{ElementType::Line, 0, {b[0], b[1], b[2], b[3]}};
+    return boxes_overlap(bounds(ra), bounds(rb));
+  }
+  return true;
+}
+
+// Does segment (x1, y1)-(x2, y2) touch the closed box?
+inline bool segment_touches_box(const int* s, const Bounds& box){
+  ElementRecord line{ElementType::Line, 0, {s[0], s[1], s[2], s[3]}};
+  if(!boxes_overlap(bounds(line), box)){
+    return false;
+  }
+  // Separating axis along the segment's normal: all four corners
+  // strictly on the same side means no contact
+  long long xs[2] = {box.min_x, box.max_x};
+  long long ys[2] = {box.min_y, box.max_y};
+  int positive = 0, negative = 0;
+  for(long long x: xs){
+    for(long long y: ys){
+      int side = orientation(s[0], s[1], s[2], s[3], x, y);
+      positive += side > 0;
+      negative += side < 0;
+    }
+  }
+  return positive < 4 && negative < 4;
+}
+
+// Exact overlap test between two elements (narrow phase)
+inline bool elements_overlap(const ElementRecord& a, const ElementRecord& b){
+  if(a.type > b.type){
+    return elements_overlap(b, a);
+  }
+  Bounds box_a = bounds(a), box_b = bounds(b);
+  if(!boxes_overlap(box_a, box_b)){
+    return false;
+  }
+  switch(b.type){
+  case ElementType::Rectangle:
+    // Points and rectangles overlap a rectangle iff their boxes do
+    if(a.type != ElementType::Line){
+      return true;
+    }
+    return segment_touches_box(a.v, box_b);
+  case ElementType::Line:
+    if(a.type == ElementType::Point){
+      return orientation(b.v[0], b.v[1], b.v[2], b.v[3], a.v[0], a.v[1]) == 0;
+    }
+    return segments_intersect(a.v, b.v);
+  case ElementType::Point:
+    // Two points: equal boxes means equal points
+    return true;
+  }
+  return false;
+}
+
+// Signed 256-bit integer, just wide enough for the sweep-line
+// predicates below (products of up to ~2^133 by ~2^99)
+struct Int256{
+  std::uint64_t limb[4]; // Little-endian, two's complement
+
+  Int256(wide_int value = 0){
+    unsigned __int128 bits = static_cast<unsigned __int128>(value);
+    std::uint64_t extension = value < 0 ? ~std::uint64_t{0} : 0;
+    limb[0] = std::uint64_t(bits);
+    limb[1] = std::uint64_t(bits >> 64);
+    limb[2] = limb[3] = extension;
+  }
+
+  friend Int256 operator+(const Int256& a, const Int256& b){
+    Int256 sum;
+    unsigned __int128 carry = 0;
+    for(int i = 0; i < 4; ++i){
+      carry += (unsigned __int128)a.limb[i] + b.limb[i];
+      sum.limb[i] = std::uint64_t(carry);
+      carry >>= 64;
+    }
+    return sum;
+  }
+
+  friend Int256 operator-(const Int256& a, const Int256& b){
+    Int256 negated;
+    for(int i = 0; i < 4; ++i){
+      negated.limb[i] = ~b.limb[i];
+    }
+    return a + negated + Int256{1};
+  }
+
+  // Truncated to 256 bits, which is exact while the product fits
+  friend Int256 operator*(const Int256& a, const Int256& b){
+    Int256 product{0};
+    for(int i = 0; i < 4; ++i){
+      unsigned __int128 carry = 0;
+      for(int j = 0; i + j < 4; ++j){
+        carry += (unsigned __int128)a.limb[i] * b.limb[j] + product.limb[i + j];
+        product.limb[i + j] = std::uint64_t(carry);
+        carry >>= 64;
+      }
+    }
+    return product;
+  }
+
+  int sign() const{
+    if(std::int64_t(limb[3]) < 0){
+      return -1;
+    }
+    return (limb[0] | limb[1] | limb[2] | limb[3]) != 0;
+  }
+};
+
+// Exact intersection point (x / d, y / d), d > 0
+struct IntersectionPoint{
+  wide_int x, y, d;
+
+  double approx_x() const{ return double(x) / double(d); }
+  double approx_y() const{ return double(y) / double(d); }
+};
+
+// Lexicographic order (x first, then y) on exact points
+inline int compare_points(const IntersectionPoint& a, const IntersectionPoint& b){
+  int by_x = (Int256{a.x} * Int256{b.d} - Int256{b.x} * Int256{a.d}).sign();
+  if(by_x != 0){
+    return by_x;
+  }
+  return (Int256{a.y} * Int256{b.d} - Int256{b.y} * Int256{a.d}).sign();
+}
+
+// --------------------------------------------------
+// Bentley-Ottmann sweep
+//
+// Reports every point where two or more segments meet, in
+// O((n + k) log n). The sweep line moves left to right, ties
+// broken bottom to top, so vertical segments need no special
+// casing. For collinear overlapping segments only the endpoints
+// of the shared part are reported.
+// --------------------------------------------------
+
+class SegmentSweep{
+public:
+  // A segment with (x1, y1) lexicographically before (x2, y2)
+  struct Segment{
+    long long x1, y1, x2, y2;
+    std::size_t id;
+  };
+
+  explicit SegmentSweep(std::vector<Segment> segments):
+    _segments(std::move(segments)), _status(StatusLess{this}){
+    for(auto& s: _segments){
+      if(s.x2 < s.x1 || (s.x2 == s.x1 && s.y2 < s.y1)){
+        std::swap(s.x1, s.x2);
+        std::swap(s.y1, s.y2);
+      }
+    }
+  }
+
+  // Calls report(point, ids) for each intersection point, in sweep
+  // order, with the ids of all segments through it
+  template<typename Report>
+  void run(Report&& report){
+    std::size_t n = _segments.size();
+    _positions.assign(n, _status.end());
+    for(std::size_t i = 0; i < n; ++i){
+      const Segment& s = _segments[i];
+      _events[{s.x1, s.y1, 1}].push_back(i);
+      _events[{s.x2, s.y2, 1}];
+    }
+
+    std::vector<std::size_t> starting, through, ending, involved;
+    while(!_events.empty()){
+      auto event = _events.begin();
+      _sweep = event->first;
+      starting.swap(event->second);
+      _events.erase(event);
+
+      // Segments in the status containing the event point are adjacent
+      through.clear();
+      ending.clear();
+      for(auto it = _status.lower_bound(probe); it != _status.end() && contains(*it, _sweep); ++it){
+        const Segment& s = _segments[*it];
+        IntersectionPoint last{s.x2, s.y2, 1};
+        (compare_points(last, _sweep) == 0 ? ending : through).push_back(*it);
+      }
+
+      if(starting.size() + through.size() + ending.size() > 1){
+        involved.clear();
+        for(auto* ids: {&starting, &through, &ending}){
+          for(std::size_t i: *ids){
+            involved.push_back(_segments[i].id);
+          }
+        }
+        report(_sweep, involved);
+      }
+
+      // Remove the ones ending or passing here, then (re)insert the ones
+      // starting or passing here in their order just after the sweep point
+      for(auto* ids: {&ending, &through}){
+        for(std::size_t i: *ids){
+          _status.erase(_positions[i]);
+        }
+      }
+      std::size_t inserted = 0;
+      for(auto* ids: {&starting, &through}){
+        for(std::size_t i: *ids){
+          const Segment& s = _segments[i];
+          if(s.x1 == s.x2 && s.y1 == s.y2){
+            continue; // Zero-length segments never enter the status
+          }
+          _positions[i] = _status.insert(i).first;
+          ++inserted;
+        }
+      }
+
+      auto lowest = _status.lower_bound(probe);
+      if(inserted == 0){
+        if(lowest != _status.end() && lowest != _status.begin()){
+          schedule(*std::prev(lowest), *lowest);
+        }
+      } else{
+        auto highest = std::next(lowest, inserted - 1);
+        if(lowest != _status.begin()){
+          schedule(*std::prev(lowest), *lowest);
+        }
+        if(std::next(highest) != _status.end()){
+          schedule(*highest, *std::next(highest));
+        }
+      }
+      starting.clear();
+    }
+  }
+
+private:
+  static constexpr std::size_t probe = std::size_t(-1);
+
+  struct PointLess{
+    bool operator()(const IntersectionPoint& a, const IntersectionPoint& b) const{
+      return compare_points(a, b) < 0;
+    }
+  };
+
+  // Order of segments along the sweep line, just after the sweep point
+  struct StatusLess{
+    const SegmentSweep* sweep;
+    bool operator()(std::size_t a, std::size_t b) const{
+      return sweep->compare_status(a, b) < 0;
+    }
+  };
+
+  // Height of segment `i` at the sweep line, as numerator / denominator
+  void height(std::size_t i, Int256& num, Int256& den) const{
+    if(i == probe || _segments[i].x1 == _segments[i].x2){
+      num = _sweep.y;
+      den = _sweep.d;
+      return;
+    }
+    const Segment& s = _segments[i];
+    wide_int dx = s.x2 - s.x1, dy = s.y2 - s.y1;
+    num = Int256{wide_int(s.y1) * dx} * Int256{_sweep.d}
+        + Int256{dy} * Int256{_sweep.x - wide_int(s.x1) * _sweep.d};
+    den = Int256{dx} * Int256{_sweep.d};
+  }
+
+  int compare_status(std::size_t a, std::size_t b) const{
+    if(a == b){
+      return 0;
+    }
+    Int256 num_a, den_a, num_b, den_b;
+    height(a, num_a, den_a);
+    height(b, num_b, den_b);
+    int by_height = (num_a * den_b - num_b * den_a).sign();
+    if(by_height != 0){
+      return by_height;
+    }
+    // Same height: order by slope, the probe lowest and verticals highest
+    if(a == probe || b == probe){
+      return a == probe ? -1 : 1;
+    }
+    const Segment& s = _segments[a];
+    const Segment& t = _segments[b];
+    bool s_vertical = s.x1 == s.x2, t_vertical = t.x1 == t.x2;
+    int by_slope = s_vertical || t_vertical
+      ? int(s_vertical) - int(t_vertical)
+      : [&]{
+          wide_int cross = wide_int(s.y2 - s.y1) * (t.x2 - t.x1) - wide_int(t.y2 - t.y1) * (s.x2 - s.x1);
+          return (cross > 0) - (cross < 0);
+        }();
+    if(by_slope != 0){
+      return by_slope;
+    }
+    return a < b ? -1 : 1;
+  }
+
+  bool contains(std::size_t i, const IntersectionPoint& p) const{
+    const Segment& s = _segments[i];
+    IntersectionPoint first{s.x1, s.y1, 1}, last{s.x2, s.y2, 1};
+    if(compare_points(p, first) < 0 || compare_points(last, p) < 0){
+      return false;
+    }
+    // Cross product of (last - first) and (p - first), scaled by p.d
+    Int256 cross = Int256{s.x2 - s.x1} * Int256{p.y - wide_int(s.y1) * p.d}
+                 - Int256{s.y2 - s.y1} * Int256{p.x - wide_int(s.x1) * p.d};
+    return cross.sign() == 0;
+  }
+
+  // Queue the crossing of neighbours `a` and `b` if it lies ahead
+  void schedule(std::size_t a, std::size_t b){
+    const Segment& s = _segments[a];
+    const Segment& t = _segments[b];
+    int sv[4] = {int(s.x1), int(s.y1), int(s.x2), int(s.y2)};
+    int tv[4] = {int(t.x1), int(t.y1), int(t.x2), int(t.y2)};
+    wide_int rx = s.x2 - s.x1, ry = s.y2 - s.y1;
+    wide_int qx = t.x2 - t.x1, qy = t.y2 - t.y1;
+    wide_int den = rx * qy - ry * qx;
+    if(den == 0 || !segments_intersect(sv, tv)){
+      return; // Disjoint, or collinear: those meet at endpoints
+    }
+    wide_int num = wide_int(t.x1 - s.x1) * qy - wide_int(t.y1 - s.y1) * qx;
+    if(den < 0){
+      den = -den;
+      num = -num;
+    }
+    IntersectionPoint point{wide_int(s.x1) * den + num * rx, wide_int(s.y1) * den + num * ry, den};
+    if(compare_points(_sweep, point) < 0){
+      _events[point];
+    }
+  }
+
+  std::vector<Segment> _segments;
+  std::map<IntersectionPoint, std::vector<std::size_t>, PointLess> _events;
+  std::set<std::size_t, StatusLess> _status;
+  std::vector<std::set<std::size_t, StatusLess>::iterator> _positions;
+  IntersectionPoint _sweep{0, 0, 1};
+};
+
+// --------------------------------------------------
+// k-d tree over points
+//
+// Implicit layout: the tree is a single array where the node for
+// a range [begin, end) sits at its middle, with the left subtree
+// in [begin, mid) and the right one in (mid, end). Levels split
+// on x and y alternately. No child pointers, no per-node allocation.
+// --------------------------------------------------
+
+class PointIndex{
+public:
+  struct Entry{
+    long long x, y; // Rectangle corners can fall outside int
+    std::size_t element; // Index of the element the point came from
+  };
+
+  struct Neighbour{
+    Entry entry;
+    double distance_sq;
+  };
+
+  PointIndex(){}
+
+  // Build over `entries`; the top levels are built in parallel
+  explicit PointIndex(std::vector<Entry> entries):
+    _entries(std::move(entries)){
+    std::size_t workers = worker_count(_entries.size(), 1 << 15);
+    int parallel_depth = 0;
+    while((std::size_t(1) << parallel_depth) < workers){
+      ++parallel_depth;
+    }
+    build(0, _entries.size(), 0, parallel_depth);
+  }
+
+  std::size_t size() const{
+    return _entries.size();
+  }
+
+  // The k points closest to (x, y), nearest first
+  std::vector<Neighbour> nearest(int x, int y, std::size_t k) const{
+    std::vector<Neighbour> heap; // Max-heap on distance, at most k entries
+    if(k > 0){
+      heap.reserve(k + 1);
+      nearest(0, _entries.size(), 0, x, y, k, heap);
+    }
+    std::sort_heap(heap.begin(), heap.end(), farther_first);
+    return heap;
+  }
+
+  // All points within `radius` of (x, y), in no particular order
+  std::vector<Entry> within(int x, int y, double radius) const{
+    std::vector<Entry> found;
+    within(0, _entries.size(), 0, x, y, radius * radius, found);
+    return found;
+  }
+
+private:
+  static bool farther_first(const Neighbour& a, const Neighbour& b){
+    return a.distance_sq < b.distance_sq;
+  }
+
+  static long long coordinate(const Entry& entry, int axis){
+    return axis == 0 ? entry.x : entry.y;
+  }
+
+  static double distance_sq(const Entry& entry, int x, int y){
+    double dx = double(entry.x) - x, dy = double(entry.y) - y;
+    return dx * dx + dy * dy;
+  }
+
+  void build(std::size_t begin, std::size_t end, int depth, int parallel_depth){
+    if(end - begin <= 1){
+      return;
+    }
+    int axis = depth % 2;
+    std::size_t mid = begin + (end - begin) / 2;
+    std::nth_element(_entries.begin() + begin, _entries.begin() + mid, _entries.begin() + end,
+                     [axis](const Entry& a, const Entry& b){
+                       return coordinate(a, axis) < coordinate(b, axis);
+                     });
+    if(depth < parallel_depth){
+      std::thread left{[=]{ build(begin, mid, depth + 1, parallel_depth); }};
+      build(mid + 1, end, depth + 1, parallel_depth);
+      left.join();
+    } else{
+      build(begin, mid, depth + 1, parallel_depth);
+      build(mid + 1, end, depth + 1, parallel_depth);
+    }
+  }
+
+  void nearest(std::size_t begin, std::size_t end, int depth, int x, int y,
+               std::size_t k, std::vector<Neighbour>& heap) const{
+    if(begin >= end){
+      return;
+    }
+    std::size_t mid = begin + (end - begin) / 2;
+    const Entry& node = _entries[mid];
+
+    double d = distance_sq(node, x, y);
+    if(heap.size() < k || d < heap.front().distance_sq){
+      heap.push_back({node, d});
+      std::push_heap(heap.begin(), heap.end(), farther_first);
+      if(heap.size() > k){
+        std::pop_heap(heap.begin(), heap.end(), farther_first);
+        heap.pop_back();
+      }
+    }
+
+    // Near side first; the far side only if the splitting line is closer
+    // than the current k-th neighbour
+    int axis = depth % 2;
+    double delta = double(axis == 0 ? x : y) - coordinate(node, axis);
+    bool go_left = delta < 0;
+    if(go_left){
+      nearest(begin, mid, depth + 1, x, y, k, heap);
+    } else{
+      nearest(mid + 1, end, depth + 1, x, y, k, heap);
+    }
+    if(heap.size() < k || delta * delta < heap.front().distance_sq){
+      if(go_left){
+        nearest(mid + 1, end, depth + 1, x, y, k, heap);
+      } else{
+        nearest(begin, mid, depth + 1, x, y, k, heap);
+      }
+    }
+  }
+
+  void within(std::size_t begin, std::size_t end, int depth, int x, int y,
+              double radius_sq, std::vector<Entry>& found) const{
+    if(begin >= end){
+      return;
+    }
+    std::size_t mid = begin + (end - begin) / 2;
+    const Entry& node = _entries[mid];
+    if(distance_sq(node, x, y) <= radius_sq){
+      found.push_back(node);
+    }
+    int axis = depth % 2;
+    double delta = double(axis == 0 ? x : y) - coordinate(node, axis);
+    if(delta <= 0 || delta * delta <= radius_sq){
+      within(begin, mid, depth + 1, x, y, radius_sq, found);
+    }
+    if(delta >= 0 || delta * delta <= radius_sq){
+      within(mid + 1, end, depth + 1, x, y, radius_sq, found);
+    }
+  }
+
+  std::vector<Entry> _entries;
+};
+
+// --------------------------------------------------
+// Geometry columns and statistics
+//
+// The geometry of each element type stored column by column,
+// so that scans over many elements are plain loops over ints
+// instead of one virtual call per element. The reductions below
+// use AVX2 when the CPU has it, chosen at run time.
+// --------------------------------------------------
+
+struct GeometryColumns{
+  std::vector<int> point_x, point_y;
+  std::vector<int> line_x1, line_y1, line_x2, line_y2;
+  std::vector<int> rect_x, rect_y, rect_w, rect_h;
+
+  // Handle of the element in each position, to get back to it
+  std::vector<ElementHandle> point_handle, line_handle, rect_handle;
+
+  void clear(){
+    for(auto* column: {&point_x, &point_y, &line_x1, &line_y1, &line_x2, &line_y2,
+                       &rect_x, &rect_y, &rect_w, &rect_h}){
+      column->clear();
+    }
+    point_handle.clear();
+    line_handle.clear();
+    rect_handle.clear();
+  }
+
+  // Position of the next element of `type` in its columns
+  std::size_t next_slot(ElementType type) const{
+    switch(type){
+    case ElementType::Point:     return point_x.size();
+    case ElementType::Line:      return line_x1.size();
+    case ElementType::Rectangle: return rect_x.size();
+    }
+    return 0;
+  }
+
+  // Overwrite the element at `slot` of its type's columns
+  void assign(std::size_t slot, const ElementRecord& record){
+    const int* v = record.v;
+    switch(record.type){
+    case ElementType::Point:
+      point_x[slot] = v[0]; point_y[slot] = v[1];
+      break;
+    case ElementType::Line:
+      line_x1[slot] = v[0]; line_y1[slot] = v[1];
+      line_x2[slot] = v[2]; line_y2[slot] = v[3];
+      break;
+    case ElementType::Rectangle:
+      rect_x[slot] = v[0]; rect_y[slot] = v[1];
+      rect_w[slot] = v[2]; rect_h[slot] = v[3];
+      break;
+    }
+  }
+
+  void append(const ElementRecord& record, ElementHandle handle = 0){
+    const int* v = record.v;
+    switch(record.type){
+    case ElementType::Point:
+      point_x.push_back(v[0]); point_y.push_back(v[1]);
+      point_handle.push_back(handle);
+      break;
+    case ElementType::Line:
+      line_x1.push_back(v[0]); line_y1.push_back(v[1]);
+      line_x2.push_back(v[2]); line_y2.push_back(v[3]);
+      line_handle.push_back(handle);
+      break;
+    case ElementType::Rectangle:
+      rect_x.push_back(v[0]); rect_y.push_back(v[1]);
+      rect_w.push_back(v[2]); rect_h.push_back(v[3]);
+      rect_handle.push_back(handle);
+      break;
+    }
+  }
+
+  // Move everything by (dx, dy), in place
+  void translate(int dx, int dy){
+    for(auto* column: {&point_x, &line_x1, &line_x2, &rect_x}){
+      for(int& x: *column){
+        x += dx;
+      }
+    }
+    for(auto* column: {&point_y, &line_y1, &line_y2, &rect_y}){
+      for(int& y: *column){
+        y += dy;
+      }
+    }
+  }
+
+  // Call hit(type, position) for every element whose bounding box
+  // meets `box`, one plain loop per type. The tests are combined
+  // with `&`, not `&&`, so each element costs one branch, taken
+  // only for hits.
+  template<typename Hit>
+  void cull(const Bounds& box, Hit&& hit) const{
+    for(std::size_t i = 0; i < point_x.size(); ++i){
+      long long x = point_x[i], y = point_y[i];
+      if((x >= box.min_x) & (x <= box.max_x) & (y >= box.min_y) & (y <= box.max_y)){
+        hit(ElementType::Point, i);
+      }
+    }
+    for(std::size_t i = 0; i < line_x1.size(); ++i){
+      long long x1 = line_x1[i], y1 = line_y1[i], x2 = line_x2[i], y2 = line_y2[i];
+      if((std::max(x1, x2) >= box.min_x) & (std::min(x1, x2) <= box.max_x)
+         & (std::max(y1, y2) >= box.min_y) & (std::min(y1, y2) <= box.max_y)){
+        hit(ElementType::Line, i);
+      }
+    }
+    for(std::size_t i = 0; i < rect_x.size(); ++i){
+      long long x1 = rect_x[i], y1 = rect_y[i], x2 = x1 + rect_w[i], y2 = y1 + rect_h[i];
+      if((std::max(x1, x2) >= box.min_x) & (std::min(x1, x2) <= box.max_x)
+         & (std::max(y1, y2) >= box.min_y) & (std::min(y1, y2) <= box.max_y)){
+        hit(ElementType::Rectangle, i);
+      }
+    }
+  }
+
+  // Plain-data copy of the element at `position` of `type`'s columns
+  ElementRecord record(ElementType type, std::size_t i) const{
+    switch(type){
+    case ElementType::Point:     return {type, 0, {point_x[i], point_y[i], 0, 0}};
+    case ElementType::Line:      return {type, 0, {line_x1[i], line_y1[i], line_x2[i], line_y2[i]}};
+    case ElementType::Rectangle: return {type, 0, {rect_x[i], rect_y[i], rect_w[i], rect_h[i]}};
+    }
+    return {removed_element, 0, {0, 0, 0, 0}};
+  }
+
+  ElementHandle handle(ElementType type, std::size_t i) const{
+    switch(type){
+    case ElementType::Point:     return point_handle[i];
+    case ElementType::Line:      return line_handle[i];
+    case ElementType::Rectangle: return rect_handle[i];
+    }
+    return 0;
+  }
+};
+
+// Minimum, maximum and sum of a column, or of the sum of two;
+// 64 bits, since x + w can fall outside int
+struct ColumnSummary{
+  long long min{std::numeric_limits<long long>::max()};
+  long long max{std::numeric_limits<long long>::min()};
+  long long sum{0};
+  std::size_t count{0};
+
+  void merge(const ColumnSummary& other){
+    min    = std::min(min, other.min);
+    max    = std::max(max, other.max);
+    sum   += other.sum;
+    count += other.count;
+  }
+};
+
+// Scalar kernels, also used for the tails of the vector ones
+
+// Summary of a[i] + b[i] (or just a[i] when b is null)
+inline void summarize_scalar(const int* a, const int* b, std::size_t n, ColumnSummary& out){
+  for(std::size_t i = 0; i < n; ++i){
+    long long value = b != nullptr ? (long long)a[i] + b[i] : a[i];
+    out.min  = std::min(out.min, value);
+    out.max  = std::max(out.max, value);
+    out.sum += value;
+  }
+  out.count += n;
+}
+
+// Sum of |w[i] * h[i]|
+inline double sum_areas_scalar(const int* w, const int* h, std::size_t n){
+  double sum = 0;
+  for(std::size_t i = 0; i < n; ++i){
+    sum += std::fabs(double(w[i]) * double(h[i]));
+  }
+  return sum;
+}
+
+// Sum of the lengths of segments (x1, y1)-(x2, y2)
+inline double sum_lengths_scalar(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n){
+  double sum = 0;
+  for(std::size_t i = 0; i < n; ++i){
+    double dx = double(x2[i]) - x1[i], dy = double(y2[i]) - y1[i];
+    sum += std::sqrt(dx * dx + dy * dy);
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+inline bool cpu_has_avx2(){
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+}
+
+// a[i] + b[i] widened to 64 bits first, four at a time: AVX2 has
+// no 64-bit min or max, so they're a compare and a blend
+__attribute__((target("avx2")))
+inline void summarize_sums_avx2(const int* a, const int* b, std::size_t n, ColumnSummary& out){
+  __m256i min = _mm256_set1_epi64x(out.min), max = _mm256_set1_epi64x(out.max);
+  __m256i sum = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256i value = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))),
+                                     _mm256_cvtepi32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+    min = _mm256_blendv_epi8(min, value, _mm256_cmpgt_epi64(min, value));
+    max = _mm256_blendv_epi8(max, value, _mm256_cmpgt_epi64(value, max));
+    sum = _mm256_add_epi64(sum, value);
+  }
+  alignas(32) long long mins[4], maxs[4], sums[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(mins), min);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(maxs), max);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sums), sum);
+  for(int lane = 0; lane < 4; ++lane){
+    out.min = std::min(out.min, mins[lane]);
+    out.max = std::max(out.max, maxs[lane]);
+  }
+  out.sum   += sums[0] + sums[1] + sums[2] + sums[3];
+  out.count += i;
+  summarize_scalar(a + i, b + i, n - i, out);
+}
+
+__attribute__((target("avx2")))
+inline void summarize_avx2(const int* a, const int* b, std::size_t n, ColumnSummary& out){
+  if(b != nullptr){
+    summarize_sums_avx2(a, b, n, out);
+    return;
+  }
+  // A single column fits in 32-bit lanes
+  __m256i min = _mm256_set1_epi32(std::numeric_limits<int>::max());
+  __m256i max = _mm256_set1_epi32(std::numeric_limits<int>::min());
+  __m256i sum_low = _mm256_setzero_si256(), sum_high = _mm256_setzero_si256();
+  std::size_t i = 0;
+  for(; i + 8 <= n; i += 8){
+    __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    min = _mm256_min_epi32(min, value);
+    max = _mm256_max_epi32(max, value);
+    // Widen to 64 bits before summing
+    sum_low  = _mm256_add_epi64(sum_low,  _mm256_cvtepi32_epi64(_mm256_castsi256_si128(value)));
+    sum_high = _mm256_add_epi64(sum_high, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(value, 1)));
+  }
+  alignas(32) int mins[8], maxs[8];
+  alignas(32) long long sums[4];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(mins), min);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(maxs), max);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(sums), _mm256_add_epi64(sum_low, sum_high));
+  for(int lane = 0; lane < 8 && i > 0; ++lane){
+    out.min = std::min<long long>(out.min, mins[lane]);
+    out.max = std::max<long long>(out.max, maxs[lane]);
+  }
+  out.sum   += sums[0] + sums[1] + sums[2] + sums[3];
+  out.count += i;
+  summarize_scalar(a + i, b != nullptr ? b + i : nullptr, n - i, out);
+}
+
+__attribute__((target("avx2")))
+inline double sum_areas_avx2(const int* w, const int* h, std::size_t n){
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d sum = _mm256_setzero_pd();
+  std::size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256d width  = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+    __m256d height = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i)));
+    sum = _mm256_add_pd(sum, _mm256_andnot_pd(sign, _mm256_mul_pd(width, height)));
+  }
+  alignas(32) double sums[4];
+  _mm256_store_pd(sums, sum);
+  return sums[0] + sums[1] + sums[2] + sums[3] + sum_areas_scalar(w + i, h + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline double sum_lengths_avx2(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n){
+  __m256d sum = _mm256_setzero_pd();
+  std::size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256d dx = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x2 + i))),
+                               _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x1 + i))));
+    __m256d dy = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y2 + i))),
+                               _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y1 + i))));
+    sum = _mm256_add_pd(sum, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+  }
+  alignas(32) double sums[4];
+  _mm256_store_pd(sums, sum);
+  return sums[0] + sums[1] + sums[2] + sums[3]
+       + sum_lengths_scalar(x1 + i, y1 + i, x2 + i, y2 + i, n - i);
+}
+
+#endif
+
+inline void summarize(const int* a, const int* b, std::size_t n, ColumnSummary& out){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    summarize_avx2(a, b, n, out);
+    return;
+  }
+#endif
+  summarize_scalar(a, b, n, out);
+}
+
+inline double sum_areas(const int* w, const int* h, std::size_t n){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    return sum_areas_avx2(w, h, n);
+  }
+#endif
+  return sum_areas_scalar(w, h, n);
+}
+
+inline double sum_lengths(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    return sum_lengths_avx2(x1, y1, x2, y2, n);
+  }
+#endif
+  return sum_lengths_scalar(x1, y1, x2, y2, n);
+}
+
+struct DrawingStats{
+  std::size_t points{0}, lines{0}, rectangles{0};
+  double rectangle_area{0};
+  double line_length{0};
+
+  // Extent and centroid of all vertices: points, line endpoints and
+  // rectangle corners (the centroid counts two opposite corners, so
+  // a rectangle weighs in at its center). Zero for an empty drawing.
+  long long min_x{0}, min_y{0}, max_x{0}, max_y{0};
+  double centroid_x{0}, centroid_y{0};
+};
+
+// Each worker reduces its share of every column; partial results are merged
+inline DrawingStats compute_stats(const GeometryColumns& c){
+  struct Partial{
+    ColumnSummary x, y;
+    double area{0}, length{0};
+  };
+
+  std::size_t points = c.point_x.size(), lines = c.line_x1.size(), rects = c.rect_x.size();
+  std::size_t workers = worker_count(points + lines + rects, 1 << 16);
+  std::vector<Partial> partials(workers);
+
+  parallel_for(workers, [&](std::size_t, std::size_t first, std::size_t last){
+    for(std::size_t w = first; w < last; ++w){
+      Partial& p = partials[w];
+      auto share = [&](std::size_t n, std::size_t& begin){
+        begin = n * w / workers;
+        return n * (w + 1) / workers - begin;
+      };
+      std::size_t begin, n;
+
+      n = share(points, begin);
+      summarize(c.point_x.data() + begin, nullptr, n, p.x);
+      summarize(c.point_y.data() + begin, nullptr, n, p.y);
+
+      n = share(lines, begin);
+      summarize(c.line_x1.data() + begin, nullptr, n, p.x);
+      summarize(c.line_y1.data() + begin, nullptr, n, p.y);
+      summarize(c.line_x2.data() + begin, nullptr, n, p.x);
+      summarize(c.line_y2.data() + begin, nullptr, n, p.y);
+      p.length = sum_lengths(c.line_x1.data() + begin, c.line_y1.data() + begin,
+                             c.line_x2.data() + begin, c.line_y2.data() + begin, n);
+
+      n = share(rects, begin);
+      summarize(c.rect_x.data() + begin, nullptr, n, p.x);
+      summarize(c.rect_y.data() + begin, nullptr, n, p.y);
+      summarize(c.rect_x.data() + begin, c.rect_w.data() + begin, n, p.x);
+      summarize(c.rect_y.data() + begin, c.rect_h.data() + begin, n, p.y);
+      p.area = sum_areas(c.rect_w.data() + begin, c.rect_h.data() + begin, n);
+    }
+  }, 1);
+
+  Partial total;
+  for(const Partial& p: partials){
+    total.x.merge(p.x);
+    total.y.merge(p.y);
+    total.area   += p.area;
+    total.length += p.length;
+  }
+
+  DrawingStats stats;
+  stats.points         = points;
+  stats.lines          = lines;
+  stats.rectangles     = rects;
+  stats.rectangle_area = total.area;
+  stats.line_length    = total.length;
+  if(total.x.count > 0){
+    stats.min_x = total.x.min;
+    stats.max_x = total.x.max;
+    stats.min_y = total.y.min;
+    stats.max_y = total.y.max;
+    stats.centroid_x = double(total.x.sum) / double(total.x.count);
+    stats.centroid_y = double(total.y.sum) / double(total.y.count);
+  }
+  return stats;
+}
+
+// --------------------------------------------------
+// Line clipping
+//
+// Liang-Barsky clipping of the line columns against a viewport,
+// so that lines reaching far off-canvas are cut to the part that
+// shows before anything is rasterized, and lines whose bounding
+// box meets the viewport but which pass it by are dropped. Four
+// lines at a time with AVX2 when the CPU has it; both kernels
+// give the same results, bit for bit.
+// --------------------------------------------------
+
+// The lines that show in a viewport: the first size() entries of
+// each column are their clipped endpoints and the handles of the
+// lines they came from. The columns only grow, so a buffer reused
+// between calls isn't cleared again every time.
+struct ClippedLines{
+  std::vector<double> x1, y1, x2, y2;
+  std::vector<ElementHandle> handle;
+  std::size_t count{0};
+
+  std::size_t size() const{ return count; }
+
+  // Room for n lines
+  void reserve(std::size_t n){
+    if(handle.size() < n){
+      for(auto* column: {&x1, &y1, &x2, &y2}){
+        column->resize(n);
+      }
+      handle.resize(n);
+    }
+  }
+};
+
+// Narrow [t0, t1] to the part of origin + t * delta within [low, high];
+// false if a line parallel to the axis lies outside
+inline bool clip_axis(double origin, double delta, double low, double high, double& t0, double& t1){
+  if(delta == 0){
+    return low <= origin && origin <= high;
+  }
+  double inverse = 1 / delta;
+  double ta = (low - origin) * inverse, tb = (high - origin) * inverse;
+  t0 = std::max(t0, std::min(ta, tb));
+  t1 = std::min(t1, std::max(ta, tb));
+  return true;
+}
+
+// Clip lines [0, n) of the columns, writing the kept ones to `out`
+// from position `kept` on; `out` has room for all n. Returns the
+// new number kept. Handles are column positions, offset by `first`.
+inline std::size_t clip_lines_scalar(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n,
+                                     std::size_t first, const Bounds& box, ClippedLines& out, std::size_t kept){
+  const double min_x = double(box.min_x), max_x = double(box.max_x);
+  const double min_y = double(box.min_y), max_y = double(box.max_y);
+  for(std::size_t i = 0; i < n; ++i){
+    double ax = x1[i], ay = y1[i], dx = double(x2[i]) - ax, dy = double(y2[i]) - ay;
+    double t0 = 0, t1 = 1;
+    if(!clip_axis(ax, dx, min_x, max_x, t0, t1) || !clip_axis(ay, dy, min_y, max_y, t0, t1) || t0 > t1){
+      continue;
+    }
+    out.x1[kept] = ax + t0 * dx;
+    out.y1[kept] = ay + t0 * dy;
+    out.x2[kept] = ax + t1 * dx;
+    out.y2[kept] = ay + t1 * dy;
+    out.handle[kept] = first + i;
+    ++kept;
+  }
+  return kept;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// One axis of four lines: narrows t0 and t1, and returns the lanes
+// parallel to the axis and outside it
+__attribute__((target("avx2")))
+inline __m256d clip_axis_avx2(__m256d origin, __m256d delta, __m256d low, __m256d high, __m256d& t0, __m256d& t1){
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d infinity = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+  __m256d parallel = _mm256_cmp_pd(delta, zero, _CMP_EQ_OQ);
+  __m256d inverse = _mm256_div_pd(_mm256_set1_pd(1.0), delta);
+  __m256d ta = _mm256_mul_pd(_mm256_sub_pd(low, origin), inverse);
+  __m256d tb = _mm256_mul_pd(_mm256_sub_pd(high, origin), inverse);
+  // Parallel lanes divide by zero; they don't narrow anything
+  __m256d enter = _mm256_blendv_pd(_mm256_min_pd(ta, tb), _mm256_sub_pd(zero, infinity), parallel);
+  __m256d leave = _mm256_blendv_pd(_mm256_max_pd(ta, tb), infinity, parallel);
+  t0 = _mm256_max_pd(t0, enter);
+  t1 = _mm256_min_pd(t1, leave);
+  __m256d outside = _mm256_or_pd(_mm256_cmp_pd(origin, low, _CMP_LT_OQ), _mm256_cmp_pd(origin, high, _CMP_GT_OQ));
+  return _mm256_and_pd(parallel, outside);
+}
+
+__attribute__((target("avx2")))
+inline std::size_t clip_lines_avx2(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n,
+                                   std::size_t first, const Bounds& box, ClippedLines& out, std::size_t kept){
+  const __m256d min_x = _mm256_set1_pd(double(box.min_x)), max_x = _mm256_set1_pd(double(box.max_x));
+  const __m256d min_y = _mm256_set1_pd(double(box.min_y)), max_y = _mm256_set1_pd(double(box.max_y));
+  const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+  alignas(32) double cx1[4], cy1[4], cx2[4], cy2[4];
+  std::size_t i = 0;
+  for(; i + 4 <= n; i += 4){
+    __m256d ax = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x1 + i)));
+    __m256d ay = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y1 + i)));
+    __m256d dx = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x2 + i))), ax);
+    __m256d dy = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y2 + i))), ay);
+    __m256d t0 = zero, t1 = one;
+    __m256d rejected = _mm256_or_pd(clip_axis_avx2(ax, dx, min_x, max_x, t0, t1),
+                                    clip_axis_avx2(ay, dy, min_y, max_y, t0, t1));
+    rejected = _mm256_or_pd(rejected, _mm256_cmp_pd(t0, t1, _CMP_GT_OQ));
+    int keep = ~_mm256_movemask_pd(rejected) & 0xF;
+    _mm256_store_pd(cx1, _mm256_add_pd(ax, _mm256_mul_pd(t0, dx)));
+    _mm256_store_pd(cy1, _mm256_add_pd(ay, _mm256_mul_pd(t0, dy)));
+    _mm256_store_pd(cx2, _mm256_add_pd(ax, _mm256_mul_pd(t1, dx)));
+    _mm256_store_pd(cy2, _mm256_add_pd(ay, _mm256_mul_pd(t1, dy)));
+    // Compact without a branch per lane: every lane is written,
+    // and `kept` only moves past the ones that stay
+    for(int lane = 0; lane < 4; ++lane){
+      out.x1[kept] = cx1[lane];
+      out.y1[kept] = cy1[lane];
+      out.x2[kept] = cx2[lane];
+      out.y2[kept] = cy2[lane];
+      out.handle[kept] = first + i + lane;
+      kept += (keep >> lane) & 1;
+    }
+  }
+  return clip_lines_scalar(x1 + i, y1 + i, x2 + i, y2 + i, n - i, first + i, box, out, kept);
+}
+
+#endif
+
+inline std::size_t clip_lines(const int* x1, const int* y1, const int* x2, const int* y2, std::size_t n,
+                              std::size_t first, const Bounds& box, ClippedLines& out, std::size_t kept){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    return clip_lines_avx2(x1, y1, x2, y2, n, first, box, out, kept);
+  }
+#endif
+  return clip_lines_scalar(x1, y1, x2, y2, n, first, box, out, kept);
+}
+
+// Clip every line of the columns against `box` into `out`, which is
+// reused between calls
+inline void clip_lines(const GeometryColumns& c, const Bounds& box, ClippedLines& out){
+  std::size_t n = c.line_x1.size();
+  out.reserve(n);
+  out.count = clip_lines(c.line_x1.data(), c.line_y1.data(), c.line_x2.data(), c.line_y2.data(), n, 0, box, out, 0);
+  // The kernels leave column positions; turn them into handles
+  for(std::size_t i = 0; i < out.count; ++i){
+    out.handle[i] = c.line_handle[out.handle[i]];
+  }
+}
+
+// --------------------------------------------------
+// Framebuffer and anti-aliased lines
+//
+// An 8-bit coverage framebuffer, 0 for paper and 255 for full ink,
+// and Xiaolin Wu's anti-aliased lines on it. Wu's algorithm steps
+// along the major axis of a line and splits each step's ink
+// between the two pixels straddling it, by how close each one is.
+// The steps are in 16.16 fixed point, so the AVX2 kernel takes
+// eight at a time: pixel offsets and coverage in vector registers,
+// the sixteen pixels gathered, blended and stored back. Both
+// kernels give the same pixels.
+// --------------------------------------------------
+
+class Framebuffer{
+public:
+  // Sides are limited so that 16.16 fixed-point positions and
+  // pixel offsets fit an int
+  static constexpr int max_side = (1 << 15) - 1;
+
+  Framebuffer(int width, int height):
+    _width(width), _height(height){
+    if(width <= 0 || height <= 0 || width > max_side || height > max_side){
+      throw std::invalid_argument("Framebuffer: sides must be in [1, " + std::to_string(max_side) + "]");
+    }
+    // Three bytes past the last pixel, since gathers read four bytes at a pixel
+    _pixels.assign(size() + 3, 0);
+  }
+
+  int width() const{ return _width; }
+  int height() const{ return _height; }
+  std::size_t size() const{ return std::size_t(_width) * std::size_t(_height); }
+
+  // Rows top to bottom, `width` pixels each
+  std::uint8_t* data(){ return _pixels.data(); }
+  const std::uint8_t* data() const{ return _pixels.data(); }
+
+  std::uint8_t at(int x, int y) const{
+    if(x < 0 || y < 0 || x >= _width || y >= _height){
+      throw std::out_of_range("Framebuffer::at: pixel outside the framebuffer");
+    }
+    return _pixels[std::size_t(y) * _width + x];
+  }
+
+  void clear(std::uint8_t value = 0){
+    std::fill(_pixels.begin(), _pixels.begin() + size(), value);
+  }
+
+  // Ink `coverage` (0 to 255) over pixel (x, y); pixels outside are ignored
+  void blend(int x, int y, unsigned coverage);
+
+  // Binary PGM image, ink dark on white paper
+  void write_pgm(std::ostream& out) const{
+    out << "P5\n" << _width << " " << _height << "\n255\n";
+    std::vector<char> row(_width);
+    for(int y = 0; y < _height; ++y){
+      const std::uint8_t* pixels = data() + std::size_t(y) * _width;
+      for(int x = 0; x < _width; ++x){
+        row[x] = char(255 - pixels[x]);
+      }
+      out.write(row.data(), _width);
+    }
+  }
+
+private:
+  int _width, _height;
+  std::vector<std::uint8_t> _pixels;
+};
+
+// Ink `coverage` over a pixel holding `pixel`: p + (255 - p) * c / 255,
+// rounded, with the division done by shifts
+inline std::uint8_t blend_ink(unsigned pixel, unsigned coverage){
+  unsigned t = (255 - pixel) * coverage + 128;
+  return std::uint8_t(pixel + ((t + (t >> 8)) >> 8));
+}
+
+inline void Framebuffer::blend(int x, int y, unsigned coverage){
+  if(x >= 0 && y >= 0 && x < _width && y < _height){
+    std::uint8_t& pixel = _pixels[std::size_t(y) * _width + x];
+    pixel = blend_ink(pixel, coverage);
+  }
+}
+
+// The interior steps of a line, after its endpoints are drawn
+struct WuLine{
+  bool steep;        // Major axis is y; x and y are swapped below
+  int  first, last;  // Major-axis range of the steps
+  int  minor;        // 16.16 minor-axis position at `first`
+  int  gradient;     // 16.16 change of `minor` per step
+};
+
+// Clip a line to the framebuffer, draw its two endpoints (which
+// Wu's algorithm weighs by how much of their pixel they cover) and
+// set up its interior steps. False if there are none.
+inline bool wu_begin(Framebuffer& fb, double x0, double y0, double x1, double y1, WuLine& line){
+  double t0 = 0, t1 = 1, dx = x1 - x0, dy = y1 - y0;
+  if(!clip_axis(x0, dx, 0, fb.width() - 1, t0, t1) || !clip_axis(y0, dy, 0, fb.height() - 1, t0, t1) || t0 > t1){
+    return false;
+  }
+  x1 = x0 + t1 * dx; y1 = y0 + t1 * dy;
+  x0 = x0 + t0 * dx; y0 = y0 + t0 * dy;
+
+  line.steep = std::fabs(y1 - y0) > std::fabs(x1 - x0);
+  if(line.steep){
+    std::swap(x0, y0);
+    std::swap(x1, y1);
+  }
+  if(x0 > x1){
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+  }
+  double gradient = x1 == x0 ? 1 : (y1 - y0) / (x1 - x0);
+  auto fraction = [](double v){ return v - std::floor(v); };
+  auto plot = [&](int major, int minor, double coverage){
+    unsigned c = unsigned(coverage * 255 + 0.5);
+    line.steep ? fb.blend(minor, major, c) : fb.blend(major, minor, c);
+  };
+  auto endpoint = [&](double x, double y, double gap){
+    double end = std::round(x), minor = y + gradient * (end - x);
+    int pixel = int(std::floor(minor));
+    plot(int(end), pixel,     (1 - fraction(minor)) * gap);
+    plot(int(end), pixel + 1, fraction(minor) * gap);
+    return minor;
+  };
+  double minor = endpoint(x0, y0, 1 - fraction(x0 + 0.5)) + gradient;
+  endpoint(x1, y1, fraction(x1 + 0.5));
+
+  line.first    = int(std::round(x0)) + 1;
+  line.last     = int(std::round(x1)) - 1;
+  line.minor    = int(std::lround(minor * 65536));
+  line.gradient = int(std::lround(gradient * 65536));
+  return line.first <= line.last;
+}
+
+inline void wu_steps_scalar(Framebuffer& fb, const WuLine& line){
+  std::uint8_t* pixels = fb.data();
+  std::ptrdiff_t major_stride = line.steep ? fb.width() : 1, minor_stride = line.steep ? 1 : fb.width();
+  int limit = line.steep ? fb.width() : fb.height();
+  int minor = line.minor;
+  for(int major = line.first; major <= line.last; ++major, minor += line.gradient){
+    int pixel = minor >> 16;
+    unsigned coverage = (unsigned(minor) >> 8) & 0xFF;
+    std::ptrdiff_t offset = major * major_stride + pixel * minor_stride;
+    if(pixel >= 0 && pixel < limit){
+      pixels[offset] = blend_ink(pixels[offset], 255 - coverage);
+    }
+    if(pixel + 1 >= 0 && pixel + 1 < limit){
+      pixels[offset + minor_stride] = blend_ink(pixels[offset + minor_stride], coverage);
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// blend_ink() on eight pixels
+__attribute__((target("avx2")))
+inline __m256i blend_ink_avx2(__m256i pixel, __m256i coverage){
+  __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(_mm256_set1_epi32(255), pixel), coverage),
+                               _mm256_set1_epi32(128));
+  return _mm256_add_epi32(pixel, _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8));
+}
+
+__attribute__((target("avx2")))
+inline void wu_steps_avx2(Framebuffer& fb, const WuLine& line){
+  std::uint8_t* pixels = fb.data();
+  const int* base = reinterpret_cast<const int*>(pixels);
+  int major_stride = line.steep ? fb.width() : 1, minor_stride = line.steep ? 1 : fb.width();
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i byte = _mm256_set1_epi32(0xFF), zero = _mm256_setzero_si256();
+  const __m256i limit = _mm256_set1_epi32(line.steep ? fb.width() : fb.height());
+  const __m256i major_strides = _mm256_set1_epi32(major_stride), minor_strides = _mm256_set1_epi32(minor_stride);
+  __m256i minor = _mm256_add_epi32(_mm256_set1_epi32(line.minor), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(line.gradient)));
+  __m256i major = _mm256_add_epi32(_mm256_set1_epi32(line.first), lanes);
+  const __m256i minor_step = _mm256_set1_epi32(line.gradient * 8), major_step = _mm256_set1_epi32(8);
+  alignas(32) int low_offsets[8], high_offsets[8], lows[8], highs[8];
+
+  int first = line.first;
+  for(; first + 8 <= line.last + 1; first += 8){
+    __m256i pixel = _mm256_srai_epi32(minor, 16);
+    __m256i coverage = _mm256_and_si256(_mm256_srli_epi32(minor, 8), byte);
+    __m256i low_offset = _mm256_add_epi32(_mm256_mullo_epi32(major, major_strides), _mm256_mullo_epi32(pixel, minor_strides));
+    __m256i high_offset = _mm256_add_epi32(low_offset, minor_strides);
+    // Only the pixels inside the framebuffer are gathered and stored
+    __m256i low_inside = _mm256_and_si256(_mm256_cmpgt_epi32(pixel, _mm256_set1_epi32(-1)), _mm256_cmpgt_epi32(limit, pixel));
+    __m256i high_inside = _mm256_and_si256(_mm256_cmpgt_epi32(pixel, _mm256_set1_epi32(-2)),
+                                           _mm256_cmpgt_epi32(limit, _mm256_add_epi32(pixel, _mm256_set1_epi32(1))));
+    __m256i low = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, base, low_offset, low_inside, 1), byte);
+    __m256i high = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, base, high_offset, high_inside, 1), byte);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lows), blend_ink_avx2(low, _mm256_sub_epi32(byte, coverage)));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(highs), blend_ink_avx2(high, coverage));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(low_offsets), low_offset);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(high_offsets), high_offset);
+    // Eight steps touch sixteen different pixels, so the stores can't
+    // overwrite each other
+    int low_mask = _mm256_movemask_ps(_mm256_castsi256_ps(low_inside));
+    int high_mask = _mm256_movemask_ps(_mm256_castsi256_ps(high_inside));
+    for(int lane = 0; lane < 8; ++lane){
+      if(low_mask >> lane & 1){
+        pixels[low_offsets[lane]] = std::uint8_t(lows[lane]);
+      }
+      if(high_mask >> lane & 1){
+        pixels[high_offsets[lane]] = std::uint8_t(highs[lane]);
+      }
+    }
+    minor = _mm256_add_epi32(minor, minor_step);
+    major = _mm256_add_epi32(major, major_step);
+  }
+
+  WuLine rest = line;
+  rest.first = first;
+  rest.minor = line.minor + (first - line.first) * line.gradient;
+  wu_steps_scalar(fb, rest);
+}
+
+#endif
+
+// Anti-aliased line from (x0, y0) to (x1, y1), in pixels, with pixel
+// centres at whole coordinates; clipped to the framebuffer
+inline void draw_line(Framebuffer& fb, double x0, double y0, double x1, double y1){
+  WuLine line;
+  if(!wu_begin(fb, x0, y0, x1, y1, line)){
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    wu_steps_avx2(fb, line);
+    return;
+  }
+#endif
+  wu_steps_scalar(fb, line);
+}
+
+// The straightforward way, for comparison: every pixel of the line's
+// bounding box, its coverage from its float distance to the line
+inline void draw_line_per_pixel(Framebuffer& fb, float x0, float y0, float x1, float y1){
+  int min_x = std::max(0, int(std::floor(std::min(x0, x1))) - 1);
+  int max_x = std::min(fb.width() - 1, int(std::ceil(std::max(x0, x1))) + 1);
+  int min_y = std::max(0, int(std::floor(std::min(y0, y1))) - 1);
+  int max_y = std::min(fb.height() - 1, int(std::ceil(std::max(y0, y1))) + 1);
+  float dx = x1 - x0, dy = y1 - y0, length2 = dx * dx + dy * dy;
+  for(int y = min_y; y <= max_y; ++y){
+    for(int x = min_x; x <= max_x; ++x){
+      float t = length2 > 0 ? std::clamp(((x - x0) * dx + (y - y0) * dy) / length2, 0.0f, 1.0f) : 0.0f;
+      float ex = x0 + t * dx - x, ey = y0 + t * dy - y;
+      float coverage = 1.0f - std::sqrt(ex * ex + ey * ey);
+      if(coverage > 0){
+        std::uint8_t& pixel = fb.data()[std::size_t(y) * fb.width() + x];
+        float ink = pixel / 255.0f;
+        pixel = std::uint8_t(std::lround((ink + (1.0f - ink) * coverage) * 255.0f));
+      }
+    }
+  }
+}
+
+// --------------------------------------------------
+// Mip chain
+//
+// A framebuffer and successively halved copies of it down to 1 x 1,
+// each pixel the rounded mean of the 2 x 2 block under it (the last
+// row or column repeats where a side is odd). Zoomed-out views are
+// served from the level nearest their scale instead of rasterizing
+// again. Each level is filtered row-parallel, 32 pixels at a time
+// with AVX2, and after an edit only the pixels over the dirty
+// region are recomputed, level by level.
+// --------------------------------------------------
+
+// Pixels [first, last) of a halved row, from rows `top` and `bottom`
+// of a level `width` pixels wide
+inline void downsample_row_scalar(const std::uint8_t* top, const std::uint8_t* bottom, int width,
+                                  std::uint8_t* out, int first, int last){
+  for(int i = first; i < last; ++i){
+    int left = 2 * i, right = std::min(2 * i + 1, width - 1);
+    out[i] = std::uint8_t((top[left] + top[right] + bottom[left] + bottom[right] + 2) >> 2);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Sums of neighbouring pixels, 32 pixels into 16 16-bit sums
+__attribute__((target("avx2")))
+inline __m256i pair_sums_avx2(const std::uint8_t* row){
+  return _mm256_maddubs_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row)), _mm256_set1_epi8(1));
+}
+
+__attribute__((target("avx2")))
+inline void downsample_row_avx2(const std::uint8_t* top, const std::uint8_t* bottom, int width,
+                                std::uint8_t* out, int first, int last){
+  const __m256i two = _mm256_set1_epi16(2);
+  int i = first;
+  // Whole blocks only; a repeated last column is left to the scalar tail
+  for(; i + 32 <= last && 2 * (i + 32) <= width; i += 32){
+    __m256i low  = _mm256_add_epi16(pair_sums_avx2(top + 2 * i), pair_sums_avx2(bottom + 2 * i));
+    __m256i high = _mm256_add_epi16(pair_sums_avx2(top + 2 * i + 32), pair_sums_avx2(bottom + 2 * i + 32));
+    low  = _mm256_srli_epi16(_mm256_add_epi16(low, two), 2);
+    high = _mm256_srli_epi16(_mm256_add_epi16(high, two), 2);
+    // The pack works within 128-bit halves; put the quarters back in order
+    __m256i means = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), means);
+  }
+  downsample_row_scalar(top, bottom, width, out, i, last);
+}
+
+#endif
+
+inline void downsample_row(const std::uint8_t* top, const std::uint8_t* bottom, int width,
+                           std::uint8_t* out, int first, int last){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    downsample_row_avx2(top, bottom, width, out, first, last);
+    return;
+  }
+#endif
+  downsample_row_scalar(top, bottom, width, out, first, last);
+}
+
+class MipChain{
+public:
+  MipChain(int width, int height){
+    _levels.emplace_back(width, height);
+    while(width > 1 || height > 1){
+      width  = (width + 1) / 2;
+      height = (height + 1) / 2;
+      _levels.emplace_back(width, height);
+    }
+  }
+
+  // Level 0: draw here, then build() or update()
+  Framebuffer& base(){ return _levels.front(); }
+
+  std::size_t levels() const{ return _levels.size(); }
+
+  const Framebuffer& level(std::size_t i) const{
+    if(i >= _levels.size()){
+      throw std::out_of_range("MipChain::level: no such level");
+    }
+    return _levels[i];
+  }
+
+  // The level to show the base at `scale` view pixels per base
+  // pixel: the smallest one with at least that much detail. The
+  // scale must be positive.
+  std::size_t level_for(double scale) const{
+    if(!(scale > 0)){ // Also NaN
+      throw std::invalid_argument("MipChain::level_for: scale must be positive");
+    }
+    if(scale >= 1){
+      return 0;
+    }
+    double level = std::floor(std::log2(1 / scale));
+    return std::size_t(std::min(level, double(_levels.size() - 1)));
+  }
+
+  void build(){
+    const Framebuffer& base = _levels.front();
+    update({0, 0, base.width() - 1, base.height() - 1});
+  }
+
+  // Recompute every level over `dirty`, a region of the base in
+  // pixels (inclusive), after drawing into it
+  void update(Bounds dirty){
+    TRACE_SCOPE("MipChain::update");
+    const Framebuffer& base = _levels.front();
+    dirty.min_x = std::max(dirty.min_x, 0LL);
+    dirty.min_y = std::max(dirty.min_y, 0LL);
+    dirty.max_x = std::min(dirty.max_x, (long long)base.width() - 1);
+    dirty.max_y = std::min(dirty.max_y, (long long)base.height() - 1);
+    if(dirty.min_x > dirty.max_x || dirty.min_y > dirty.max_y){
+      return;
+    }
+    for(std::size_t k = 1; k < _levels.size(); ++k){
+      const Framebuffer& source = _levels[k - 1];
+      Framebuffer& target = _levels[k];
+      dirty = {dirty.min_x / 2, dirty.min_y / 2, dirty.max_x / 2, dirty.max_y / 2};
+      int first = int(dirty.min_x), last = int(dirty.max_x) + 1;
+      std::size_t rows = std::size_t(dirty.max_y - dirty.min_y + 1);
+      // Some 64K pixels per worker at least
+      std::size_t min_rows = std::max<std::size_t>(1, (1 << 16) / std::size_t(last - first));
+      parallel_for(rows, [&](std::size_t, std::size_t begin, std::size_t end){
+        for(std::size_t r = begin; r < end; ++r){
+          int y = int(dirty.min_y) + int(r);
+          const std::uint8_t* top = source.data() + std::size_t(2 * y) * source.width();
+          const std::uint8_t* bottom = source.data() + std::size_t(std::min(2 * y + 1, source.height() - 1)) * source.width();
+          downsample_row(top, bottom, source.width(), target.data() + std::size_t(y) * target.width(), first, last);
+        }
+      }, min_rows);
+    }
+  }
+
+private:
+  std::vector<Framebuffer> _levels;
+};
+
+// --------------------------------------------------
+// Frame streaming
+//
+// Consecutive frames go out as deltas: the frame is cut into
+// square tiles, tiles equal to the viewer's copy are skipped, and
+// each changed tile is sent as its XOR with that copy, run-length
+// coded. Unchanged pixels XOR to zero, so an edit costs little more
+// than the pixels it touched. The first frame (and any after a
+// resize or reset()) is a key frame, coded against a blank one.
+// A packet codes at most a budget of pixels' worth of tiles, so a
+// key frame or a change to most of the screen goes out over a few
+// packets instead of blowing one frame's time: the tiles left over
+// still differ from the viewer's copy and go out with the next
+// packets, first come first served. Tiles are compared 32 pixels at
+// a time with AVX2, and both compared and coded in parallel.
+//
+// Packet: FrameHeader, then per changed tile a TileHeader and its
+// coded bytes. The code is PackBits-like: a control byte c < 128
+// is followed by c + 1 literal bytes, c >= 128 by one byte that
+// repeats c - 126 times.
+// --------------------------------------------------
+
+struct FrameHeader{
+  static constexpr std::uint32_t magic_value = 0x50544644; // "PTFD"
+
+  std::uint32_t magic;
+  std::uint32_t sequence;
+  std::uint16_t width, height;
+  std::uint16_t tile;  // Side of the tiles; those on the right and bottom edges may be cut short
+  std::uint8_t  key;     // 1 if tiles are coded against a blank frame
+  std::uint8_t  partial; // 1 if changed tiles were left for the next packets
+  std::uint32_t tiles;   // Number of changed tiles that follow
+};
+
+struct TileHeader{
+  std::uint16_t column, row;
+  std::uint32_t size; // Coded bytes that follow
+};
+
+// Length, up to n, of the run of bytes equal to p[0]
+inline std::size_t run_length_scalar(const std::uint8_t* p, std::size_t n){
+  std::size_t i = 0;
+  while(i < n && p[i] == p[0]){
+    ++i;
+  }
+  return i;
+}
+
+// Bytes, up to n, before the first run of three equal ones
+inline std::size_t literal_length_scalar(const std::uint8_t* p, std::size_t n){
+  std::size_t i = 0;
+  while(i + 2 < n && !(p[i] == p[i + 1] && p[i] == p[i + 2])){
+    ++i;
+  }
+  return i + 2 < n ? i : n;
+}
+
+// Whether n bytes at a and b are equal
+inline bool bytes_equal_scalar(const std::uint8_t* a, const std::uint8_t* b, std::size_t n){
+  return std::memcmp(a, b, n) == 0;
+}
+
+// Append the run-length code of n bytes at `data` to `out`. Runs
+// start at three equal bytes; shorter ones cost as much as literals.
+inline void rle_encode_scalar(const std::uint8_t* data, std::size_t n, std::vector<std::uint8_t>& out){
+  std::size_t i = 0;
+  while(i < n){
+    std::size_t end = i + literal_length_scalar(data + i, n - i);
+    while(i < end){
+      std::size_t count = std::min<std::size_t>(end - i, 128);
+      out.push_back(std::uint8_t(count - 1));
+      out.insert(out.end(), data + i, data + i + count);
+      i += count;
+    }
+    if(i < n){
+      std::size_t run = run_length_scalar(data + i, std::min<std::size_t>(n - i, 129));
+      out.push_back(std::uint8_t(run + 126));
+      out.push_back(data[i]);
+      i += run;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+inline std::size_t run_length_avx2(const std::uint8_t* p, std::size_t n){
+  const __m256i value = _mm256_set1_epi8(char(p[0]));
+  std::size_t i = 0;
+  for(; i + 32 <= n; i += 32){
+    __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)), value);
+    unsigned differ = ~unsigned(_mm256_movemask_epi8(equal));
+    if(differ != 0){
+      return i + unsigned(__builtin_ctz(differ));
+    }
+  }
+  while(i < n && p[i] == p[0]){
+    ++i;
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+inline std::size_t literal_length_avx2(const std::uint8_t* p, std::size_t n){
+  std::size_t i = 0;
+  for(; i + 34 <= n; i += 32){
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 1));
+    __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 2));
+    unsigned starts = unsigned(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, b), _mm256_cmpeq_epi8(a, c))));
+    if(starts != 0){
+      return i + unsigned(__builtin_ctz(starts));
+    }
+  }
+  return i + literal_length_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline bool bytes_equal_avx2(const std::uint8_t* a, const std::uint8_t* b, std::size_t n){
+  std::size_t i = 0;
+  for(; i + 32 <= n; i += 32){
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                 _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+    if(!_mm256_testz_si256(x, x)){
+      return false;
+    }
+  }
+  return bytes_equal_scalar(a + i, b + i, n - i);
+}
+
+// The same, with the scans inlined
+__attribute__((target("avx2")))
+inline void rle_encode_avx2(const std::uint8_t* data, std::size_t n, std::vector<std::uint8_t>& out){
+  std::size_t i = 0;
+  while(i < n){
+    std::size_t end = i + literal_length_avx2(data + i, n - i);
+    while(i < end){
+      std::size_t count = std::min<std::size_t>(end - i, 128);
+      out.push_back(std::uint8_t(count - 1));
+      out.insert(out.end(), data + i, data + i + count);
+      i += count;
+    }
+    if(i < n){
+      std::size_t run = run_length_avx2(data + i, std::min<std::size_t>(n - i, 129));
+      out.push_back(std::uint8_t(run + 126));
+      out.push_back(data[i]);
+      i += run;
+    }
+  }
+}
+
+#endif
+
+inline bool bytes_equal(const std::uint8_t* a, const std::uint8_t* b, std::size_t n){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    return bytes_equal_avx2(a, b, n);
+  }
+#endif
+  return bytes_equal_scalar(a, b, n);
+}
+
+inline void rle_encode(const std::uint8_t* data, std::size_t n, std::vector<std::uint8_t>& out){
+#if defined(__x86_64__) || defined(__i386__)
+  if(cpu_has_avx2()){
+    rle_encode_avx2(data, n, out);
+    return;
+  }
+#endif
+  rle_encode_scalar(data, n, out);
+}
+
+// Decode exactly n bytes into `out` from [data, end); false if the
+// code is malformed or doesn't come out at n
+inline bool rle_decode(const std::uint8_t* data, const std::uint8_t* end, std::uint8_t* out, std::size_t n){
+  std::size_t i = 0;
+  while(data < end){
+    std::size_t control = *data++;
+    if(control < 128){
+      std::size_t count = control + 1;
+      if(std::size_t(end - data) < count || n - i < count){
+        return false;
+      }
+      std::memcpy(out + i, data, count);
+      data += count;
+      i += count;
+    } else{
+      std::size_t count = control - 126;
+      if(data == end || n - i < count){
+        return false;
+      }
+      std::memset(out + i, *data++, count);
+      i += count;
+    }
+  }
+  return i == n;
+}
+
+class FrameEncoder{
+public:
+  static constexpr int max_tile = 255;
+
+  // Tiles of `tile` x `tile` pixels, as many per packet as cover
+  // `pixel_budget` pixels (at least one). The default, a quarter of
+  // a 4K frame, codes in well under a 60 Hz frame.
+  explicit FrameEncoder(int tile = 64, std::size_t pixel_budget = std::size_t(1) << 21):
+    _tile(checked_tile(tile)),
+    _max_tiles(std::max<std::size_t>(1, pixel_budget / (std::size_t(_tile) * std::size_t(_tile)))){}
+
+  // Packet bringing a viewer from the last frame towards `frame`;
+  // all the way unless tiles_pending() after. Valid until the next call.
+  const std::vector<std::uint8_t>& encode(const Framebuffer& frame){
+    TRACE_SCOPE("FrameEncoder::encode");
+    bool key = _key || frame.width() != _width || frame.height() != _height;
+    if(key){
+      _width  = frame.width();
+      _height = frame.height();
+      _previous.assign(frame.size(), 0);
+      _next_tile = 0;
+      _key = false;
+    }
+    std::size_t columns = std::size_t((_width + _tile - 1) / _tile), rows = std::size_t((_height + _tile - 1) / _tile);
+    std::size_t count = columns * rows;
+
+    // Which tiles differ from the viewer's copy, a share of the rows
+    // per worker
+    _changed.resize(count);
+    parallel_for(rows, [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t row = begin; row < end; ++row){
+        for(std::size_t column = 0; column < columns; ++column){
+          _changed[row * columns + column] = tile_changed(frame, int(column), int(row));
+        }
+      }
+    }, 1);
+
+    // Up to _max_tiles of them, going on from where the last packet
+    // stopped, so that tiles held back go out before any that change
+    // later
+    _selected.clear();
+    std::size_t changed = 0;
+    for(std::size_t k = 0; k < count; ++k){
+      std::size_t t = (_next_tile + k) % count;
+      if(_changed[t]){
+        ++changed;
+        if(_selected.size() < _max_tiles){
+          _selected.push_back(std::uint32_t(t));
+        }
+      }
+    }
+    if(!_selected.empty()){
+      _next_tile = (_selected.back() + 1) % count;
+    }
+    _pending = changed - _selected.size();
+
+    // Each worker codes a share of them into its own buffer; the
+    // buffers are joined in order after
+    std::size_t workers = worker_count(_selected.size(), 16);
+    _parts.resize(workers);
+    parallel_for(workers, [&](std::size_t, std::size_t first, std::size_t last){
+      std::vector<std::uint8_t> delta(std::size_t(_tile) * _tile);
+      for(std::size_t w = first; w < last; ++w){
+        std::vector<std::uint8_t>& part = _parts[w];
+        part.clear();
+        for(std::size_t k = _selected.size() * w / workers; k < _selected.size() * (w + 1) / workers; ++k){
+          encode_tile(frame, int(_selected[k] % columns), int(_selected[k] / columns), delta, part);
+        }
+      }
+    }, 1);
+
+    FrameHeader header{FrameHeader::magic_value, _sequence++, std::uint16_t(_width), std::uint16_t(_height),
+                       std::uint16_t(_tile), std::uint8_t(key), std::uint8_t(_pending > 0),
+                       std::uint32_t(_selected.size())};
+    std::size_t size = sizeof(header);
+    for(const std::vector<std::uint8_t>& part: _parts){
+      size += part.size();
+    }
+    _packet.resize(size);
+    std::memcpy(_packet.data(), &header, sizeof(header));
+    std::size_t offset = sizeof(header);
+    for(const std::vector<std::uint8_t>& part: _parts){
+      if(part.empty()){
+        continue;
+      }
+      std::memcpy(_packet.data() + offset, part.data(), part.size());
+      offset += part.size();
+    }
+    return _packet;
+  }
+
+  // Make the next frame a key frame, e.g. for a new viewer
+  void reset(){
+    _key = true;
+  }
+
+  // Changed tiles the last packet left for the next ones; encode()
+  // again, with the same frame or a newer one, to send them
+  std::size_t tiles_pending() const{
+    return _pending;
+  }
+
+private:
+  // `tile`, if it's a valid tile side; checked before it's divided by
+  static int checked_tile(int tile){
+    if(tile < 1 || tile > max_tile){
+      throw std::invalid_argument("FrameEncoder: tile side must be in [1, " + std::to_string(max_tile) + "]");
+    }
+    return tile;
+  }
+
+  // Offset of row r of the tile at (x, y)
+  std::size_t offset(int x, int y, int r) const{
+    return std::size_t(y + r) * std::size_t(_width) + std::size_t(x);
+  }
+
+  // Whether tile (column, row) differs from the viewer's copy
+  bool tile_changed(const Framebuffer& frame, int column, int row) const{
+    int x = column * _tile, y = row * _tile;
+    int width = std::min(_tile, _width - x), height = std::min(_tile, _height - y);
+    for(int r = 0; r < height; ++r){
+      if(!bytes_equal(frame.data() + offset(x, y, r), _previous.data() + offset(x, y, r), std::size_t(width))){
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Append changed tile (column, row) to `out`, and take it as the
+  // viewer's copy
+  void encode_tile(const Framebuffer& frame, int column, int row, std::vector<std::uint8_t>& delta,
+                   std::vector<std::uint8_t>& out){
+    int x = column * _tile, y = row * _tile;
+    int width = std::min(_tile, _width - x), height = std::min(_tile, _height - y);
+    for(int r = 0; r < height; ++r){
+      const std::uint8_t* current = frame.data() + offset(x, y, r);
+      std::uint8_t* previous = _previous.data() + offset(x, y, r);
+      std::uint8_t* d = delta.data() + std::size_t(r) * width;
+      for(int i = 0; i < width; ++i){
+        d[i] = current[i] ^ previous[i];
+      }
+      std::memcpy(previous, current, std::size_t(width));
+    }
+
+    std::size_t start = out.size();
+    TileHeader header{std::uint16_t(column), std::uint16_t(row), 0};
+    out.resize(start + sizeof(header));
+    rle_encode(delta.data(), std::size_t(width) * height, out);
+    header.size = std::uint32_t(out.size() - start - sizeof(header));
+    std::memcpy(out.data() + start, &header, sizeof(header));
+  }
+
+  int _tile;
+  std::size_t _max_tiles; // Per packet
+  int _width{0}, _height{0};
+  bool _key{true};
+  std::uint32_t _sequence{0};
+  std::vector<std::uint8_t> _previous; // The viewer's copy of the frame
+  std::vector<std::uint8_t> _changed;   // Per tile, row by row
+  std::vector<std::uint32_t> _selected; // Tiles going in this packet
+  std::size_t _next_tile{0};            // Where the next packet starts looking
+  std::size_t _pending{0};
+  std::vector<std::vector<std::uint8_t>> _parts;
+  std::vector<std::uint8_t> _packet;
+};
+
+// The viewer's side: applies packets to its copy of the frame
+class FrameDecoder{
+public:
+  void decode(const std::uint8_t* data, std::size_t size){
+    TRACE_SCOPE("FrameDecoder::decode");
+    FrameHeader header;
+    if(size < sizeof(header)){
+      throw std::runtime_error("FrameDecoder: packet too short");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if(header.magic != FrameHeader::magic_value || header.tile == 0 || header.tile > FrameEncoder::max_tile){
+      throw std::runtime_error("FrameDecoder: not a frame packet");
+    }
+    if(header.key){
+      if(!_frame || _frame->width() != header.width || _frame->height() != header.height){
+        _frame = std::make_unique<Framebuffer>(header.width, header.height);
+      }
+      _frame->clear();
+    } else if(!_frame || _frame->width() != header.width || _frame->height() != header.height){
+      throw std::runtime_error("FrameDecoder: delta before a key frame");
+    }
+
+    const int tile = header.tile;
+    std::vector<std::uint8_t> delta(std::size_t(tile) * tile);
+    const std::uint8_t* p = data + sizeof(header);
+    const std::uint8_t* end = data + size;
+    for(std::uint32_t t = 0; t < header.tiles; ++t){
+      TileHeader tile_header;
+      if(std::size_t(end - p) < sizeof(tile_header)){
+        throw std::runtime_error("FrameDecoder: packet cut short");
+      }
+      std::memcpy(&tile_header, p, sizeof(tile_header));
+      p += sizeof(tile_header);
+      // In 64 bits, so that no column or row can wrap around
+      long long x = (long long)tile_header.column * tile, y = (long long)tile_header.row * tile;
+      if(x >= _frame->width() || y >= _frame->height() || std::size_t(end - p) < tile_header.size){
+        throw std::runtime_error("FrameDecoder: bad tile");
+      }
+      int width  = int(std::min<long long>(tile, _frame->width() - x));
+      int height = int(std::min<long long>(tile, _frame->height() - y));
+      if(x + width > _frame->width() || y + height > _frame->height()){
+        throw std::runtime_error("FrameDecoder: bad tile");
+      }
+      if(!rle_decode(p, p + tile_header.size, delta.data(), std::size_t(width) * height)){
+        throw std::runtime_error("FrameDecoder: bad tile");
+      }
+      p += tile_header.size;
+      for(int r = 0; r < height; ++r){
+        std::uint8_t* pixels = _frame->data() + std::size_t(y + r) * _frame->width() + std::size_t(x);
+        const std::uint8_t* d = delta.data() + std::size_t(r) * width;
+        for(int i = 0; i < width; ++i){
+          pixels[i] ^= d[i];
+        }
+      }
+    }
+    _complete = header.partial == 0;
+    ++_frames;
+  }
+
+  // Whether the frame is all there; false while the rest of a key
+  // frame or of a large change is still to come
+  bool complete() const{ return _complete; }
+
+  const Framebuffer& frame() const{
+    if(!_frame){
+      throw std::runtime_error("FrameDecoder::frame: no key frame yet");
+    }
+    return *_frame;
+  }
+
+  std::size_t frames() const{ return _frames; }
+
+private:
+  std::unique_ptr<Framebuffer> _frame;
+  std::size_t _frames{0};
+  bool _complete{false};
+};
+
+// --------------------------------------------------
+// Scene generator
+//
+// Deterministic synthetic scenes for benchmarks and stress tests.
+// Element i is a pure function of (seed, i): its random numbers
+// come from a counter-based generator seeded with both, so any
+// range can be generated on any thread and the scene is the same
+// whatever the number of workers.
+// --------------------------------------------------
+
+struct SceneConfig{
+  enum class Placement{ Uniform, Clustered, Zipf };
+  enum class Sizes{ Uniform, Exponential };
+
+  std::size_t   count{1000};
+  std::uint64_t seed{1};
+
+  // Relative weights of the element types
+  double point_weight{1}, line_weight{1}, rectangle_weight{1};
+
+  // Canvas [0, width) x [0, height)
+  int width{1 << 16}, height{1 << 16};
+
+  // Uniform over the canvas; around `clusters` random centres, within
+  // `cluster_radius`; or over a `zipf_grid` x `zipf_grid` grid of cells
+  // whose popularity falls off as rank^-zipf_exponent
+  Placement   placement{Placement::Uniform};
+  std::size_t clusters{32};
+  int         cluster_radius{1 << 11};
+  std::size_t zipf_grid{64};
+  double      zipf_exponent{1.1};
+
+  // Extent of lines and rectangles: uniform in [min_size, max_size],
+  // or exponential with mean `mean_size`, capped at max_size
+  Sizes sizes{Sizes::Uniform};
+  int   min_size{1}, max_size{256}, mean_size{32};
+
+  // Layers are drawn uniformly from [0, layers), 1 <= layers <= 32768
+  // so that each fits an ElementRecord's 16 bits
+  int layers{1};
+};
+
+class SceneGenerator{
+public:
+  explicit SceneGenerator(SceneConfig config):
+    _config(config){
+    if(config.layers < 1 || config.layers > std::numeric_limits<std::int16_t>::max() + 1){
+      throw std::invalid_argument{"SceneConfig: layers must be in [1, 32768]"};
+    }
+    double total = config.point_weight + config.line_weight + config.rectangle_weight;
+    _point_threshold = std::uint32_t(std::min(4294967295.0, 4294967296.0 * config.point_weight / total));
+    _line_threshold  = std::uint32_t(std::min(4294967295.0, 4294967296.0 * (config.point_weight + config.line_weight) / total));
+
+    Random random{config.seed, ~std::uint64_t{0}};
+    for(std::size_t c = 0; c < config.clusters; ++c){
+      std::uint64_t r = random.next();
+      _centres.push_back({scale(r >> 32, config.width), scale(r, config.height)});
+    }
+    build_zipf_table(random);
+  }
+
+  std::size_t size() const{
+    return _config.count;
+  }
+
+  // Element `i` of the scene
+  ElementRecord element(std::size_t i) const{
+    ElementRecord record;
+    generate(i, i + 1, &record);
+    return record;
+  }
+
+  // Elements [begin, end) into `out`, which must have room for them.
+  // The placement and the size distribution are picked here, once,
+  // so the loop over the elements has no branches on the config.
+  void generate(std::size_t begin, std::size_t end, ElementRecord* out) const{
+    using Placement = SceneConfig::Placement;
+    bool exponential = _config.sizes == SceneConfig::Sizes::Exponential;
+    Placement placement = _config.placement;
+    if((placement == Placement::Clustered && _centres.empty()) || (placement == Placement::Zipf && _zipf.empty())){
+      placement = Placement::Uniform;
+    }
+    switch(placement){
+    case Placement::Uniform:
+#if defined(__x86_64__) || defined(__i386__)
+      if(!exponential && cpu_has_avx2()){
+        generate_uniform_avx2(begin, end, out);
+        break;
+      }
+#endif
+      exponential ? generate_as<Placement::Uniform, true>(begin, end, out)
+                  : generate_as<Placement::Uniform, false>(begin, end, out);
+      break;
+    case Placement::Clustered:
+      exponential ? generate_as<Placement::Clustered, true>(begin, end, out)
+                  : generate_as<Placement::Clustered, false>(begin, end, out);
+      break;
+    case Placement::Zipf:
+      exponential ? generate_as<Placement::Zipf, true>(begin, end, out)
+                  : generate_as<Placement::Zipf, false>(begin, end, out);
+      break;
+    }
+  }
+
+  // The whole scene into `out`, which must have room for it,
+  // generated in parallel
+  void fill(ElementRecord* out) const{
+    TRACE_SCOPE("SceneGenerator::fill");
+    parallel_for(_config.count, [&](std::size_t, std::size_t begin, std::size_t end){
+      generate(begin, end, out + begin);
+    });
+  }
+
+  // The whole scene, in new storage
+  std::vector<ElementRecord> records() const{
+    std::vector<ElementRecord> records(_config.count);
+    fill(records.data());
+    return records;
+  }
+
+private:
+  // splitmix64 over a counter; seeded from (seed, element)
+  struct Random{
+    std::uint64_t state;
+
+    Random(std::uint64_t seed, std::uint64_t element):
+      state(mix(seed + element * 0xD1B54A32D192ED03ull)){}
+
+    static std::uint64_t mix(std::uint64_t z){
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+    }
+
+    std::uint64_t next(){
+      return mix(state += 0x9E3779B97F4A7C15ull);
+    }
+  };
+
+  struct Centre{
+    int x, y;
+  };
+
+  // Map 32 random bits to [0, n)
+  static int scale(std::uint64_t bits, int n){
+    return n <= 0 ? 0 : int(((bits & 0xFFFFFFFFull) * std::uint64_t(n)) >> 32);
+  }
+
+  // Alias table (Vose) over the Zipf-weighted cells, so drawing a cell
+  // takes one random number and one lookup. Ranks are shuffled across
+  // the grid so the popular cells are scattered over the canvas.
+  void build_zipf_table(Random& random){
+    std::size_t cells = _config.zipf_grid * _config.zipf_grid;
+    std::vector<double> weight(cells);
+    double sum = 0;
+    for(std::size_t rank = 0; rank < cells; ++rank){
+      weight[rank] = std::pow(double(rank + 1), -_config.zipf_exponent);
+      sum += weight[rank];
+    }
+    std::vector<std::size_t> cell_of_rank(cells);
+    for(std::size_t i = 0; i < cells; ++i){
+      cell_of_rank[i] = i;
+    }
+    for(std::size_t i = cells; i > 1; --i){
+      std::swap(cell_of_rank[i - 1], cell_of_rank[scale(random.next(), int(i))]);
+    }
+
+    _zipf.assign(cells, {0, 0, 0});
+    std::vector<double> scaled(cells);
+    std::vector<std::size_t> small, large;
+    for(std::size_t rank = 0; rank < cells; ++rank){
+      scaled[rank] = weight[rank] / sum * double(cells);
+      (scaled[rank] < 1.0 ? small : large).push_back(rank);
+    }
+    while(!small.empty() && !large.empty()){
+      std::size_t s = small.back(), l = large.back();
+      small.pop_back();
+      _zipf[s] = {std::uint32_t(scaled[s] * 4294967295.0), std::uint32_t(cell_of_rank[s]), std::uint32_t(cell_of_rank[l])};
+      scaled[l] -= 1.0 - scaled[s];
+      if(scaled[l] < 1.0){
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    for(auto* rest: {&small, &large}){
+      for(std::size_t rank: *rest){
+        _zipf[rank] = {0xFFFFFFFFu, std::uint32_t(cell_of_rank[rank]), std::uint32_t(cell_of_rank[rank])};
+      }
+    }
+  }
+
+  // Each 64-bit draw feeds two 32-bit values, and every type draws
+  // the same numbers, so the type (which is random) only selects
+  // results instead of steering branches.
+  template<SceneConfig::Placement placement, bool exponential>
+  void generate_as(std::size_t begin, std::size_t end, ElementRecord* out) const{
+    const SceneConfig& c = _config;
+    for(std::size_t i = begin; i < end; ++i){
+      Random random{c.seed, i};
+      ElementRecord& record = out[i - begin];
+
+      std::uint64_t r = random.next();
+      std::uint32_t kind = std::uint32_t(r >> 32);
+      int type = int(kind >= _point_threshold) + int(kind >= _line_threshold);
+      record.type  = ElementType(type);
+      record.layer = std::int16_t(scale(r, c.layers));
+
+      int x, y;
+      place<placement>(random.next(), x, y);
+
+      r = random.next();
+      int a = size<exponential>(std::uint32_t(r >> 32)), b = size<exponential>(std::uint32_t(r));
+      // Lines go in any direction from their first endpoint
+      r = random.next();
+      int line_x2 = x + (r & 1 ? -a : a);
+      int line_y2 = y + (r & 2 ? -b : b);
+
+      record.v[0] = x;
+      record.v[1] = y;
+      record.v[2] = type == 1 ? line_x2 : (type == 2 ? a : 0);
+      record.v[3] = type == 1 ? line_y2 : (type == 2 ? b : 0);
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  // z * k in each 64-bit lane, from 32 x 32-bit products: AVX2 has
+  // no 64-bit multiply
+  __attribute__((target("avx2")))
+  static __m256i multiply_avx2(__m256i z, std::uint64_t k){
+    __m256i low  = _mm256_set1_epi64x(std::int64_t(k & 0xFFFFFFFF));
+    __m256i high = _mm256_set1_epi64x(std::int64_t(k >> 32));
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(z, 32), low), _mm256_mul_epu32(z, high));
+    return _mm256_add_epi64(_mm256_mul_epu32(z, low), _mm256_slli_epi64(cross, 32));
+  }
+
+  // Random::mix() in each lane
+  __attribute__((target("avx2")))
+  static __m256i mix_avx2(__m256i z){
+    z = multiply_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 30)), 0xBF58476D1CE4E5B9ull);
+    z = multiply_avx2(_mm256_xor_si256(z, _mm256_srli_epi64(z, 27)), 0x94D049BB133111EBull);
+    return _mm256_xor_si256(z, _mm256_srli_epi64(z, 31));
+  }
+
+  // scale() of the low 32 bits of each lane
+  __attribute__((target("avx2")))
+  static __m256i scale_avx2(__m256i bits, int n){
+    return _mm256_srli_epi64(_mm256_mul_epu32(bits, _mm256_set1_epi64x(std::max(n, 0))), 32);
+  }
+
+  // generate_as<Uniform, false>() four elements at a time, one per
+  // 64-bit lane, drawing the same numbers
+  __attribute__((target("avx2")))
+  void generate_uniform_avx2(std::size_t begin, std::size_t end, ElementRecord* out) const{
+    const SceneConfig& c = _config;
+    const std::uint64_t step = 0x9E3779B97F4A7C15ull; // Random::next()'s
+    const __m256i point_below = _mm256_set1_epi64x(std::int64_t(_point_threshold) - 1);
+    const __m256i line_below  = _mm256_set1_epi64x(std::int64_t(_line_threshold) - 1);
+    const __m256i one = _mm256_set1_epi64x(1), two = _mm256_set1_epi64x(2);
+    const __m256i min_size = _mm256_set1_epi64x(c.min_size);
+    const int size_range = c.max_size - c.min_size + 1;
+
+    __m256i seed = _mm256_setr_epi64x(std::int64_t(c.seed + begin * 0xD1B54A32D192ED03ull),
+                                      std::int64_t(c.seed + (begin + 1) * 0xD1B54A32D192ED03ull),
+                                      std::int64_t(c.seed + (begin + 2) * 0xD1B54A32D192ED03ull),
+                                      std::int64_t(c.seed + (begin + 3) * 0xD1B54A32D192ED03ull));
+    const __m256i seed_step = _mm256_set1_epi64x(std::int64_t(4 * 0xD1B54A32D192ED03ull));
+
+    std::size_t i = begin;
+    for(; i + 4 <= end; i += 4){
+      __m256i state = mix_avx2(seed);
+      seed = _mm256_add_epi64(seed, seed_step);
+      __m256i r0 = mix_avx2(_mm256_add_epi64(state, _mm256_set1_epi64x(std::int64_t(step))));
+      __m256i r1 = mix_avx2(_mm256_add_epi64(state, _mm256_set1_epi64x(std::int64_t(2 * step))));
+      __m256i r2 = mix_avx2(_mm256_add_epi64(state, _mm256_set1_epi64x(std::int64_t(3 * step))));
+      __m256i r3 = mix_avx2(_mm256_add_epi64(state, _mm256_set1_epi64x(std::int64_t(4 * step))));
+
+      // Each comparison is -1 where it holds
+      __m256i kind = _mm256_srli_epi64(r0, 32);
+      __m256i is_line_or_rect = _mm256_cmpgt_epi64(kind, point_below);
+      __m256i is_rect = _mm256_cmpgt_epi64(kind, line_below);
+      __m256i is_line = _mm256_andnot_si256(is_rect, is_line_or_rect);
+      __m256i type  = _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_add_epi64(is_line_or_rect, is_rect));
+      __m256i layer = scale_avx2(r0, c.layers);
+
+      __m256i x = scale_avx2(_mm256_srli_epi64(r1, 32), c.width);
+      __m256i y = scale_avx2(r1, c.height);
+      __m256i a = _mm256_add_epi64(min_size, scale_avx2(_mm256_srli_epi64(r2, 32), size_range));
+      __m256i b = _mm256_add_epi64(min_size, scale_avx2(r2, size_range));
+
+      // x +/- a, y +/- b: negate where the sign bit is set
+      __m256i flip_x = _mm256_cmpeq_epi64(_mm256_and_si256(r3, one), one);
+      __m256i flip_y = _mm256_cmpeq_epi64(_mm256_and_si256(r3, two), two);
+      __m256i line_x2 = _mm256_add_epi64(x, _mm256_sub_epi64(_mm256_xor_si256(a, flip_x), flip_x));
+      __m256i line_y2 = _mm256_add_epi64(y, _mm256_sub_epi64(_mm256_xor_si256(b, flip_y), flip_y));
+      __m256i v2 = _mm256_or_si256(_mm256_and_si256(is_line, line_x2), _mm256_and_si256(is_rect, a));
+      __m256i v3 = _mm256_or_si256(_mm256_and_si256(is_line, line_y2), _mm256_and_si256(is_rect, b));
+
+      alignas(32) long long types[4], layers[4], xs[4], ys[4], v2s[4], v3s[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(types), type);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(layers), layer);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(xs), x);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(ys), y);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(v2s), v2);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(v3s), v3);
+      for(int lane = 0; lane < 4; ++lane){
+        ElementRecord& record = out[i - begin + lane];
+        record.type  = ElementType(types[lane]);
+        record.layer = std::int16_t(layers[lane]);
+        record.v[0] = int(xs[lane]);
+        record.v[1] = int(ys[lane]);
+        record.v[2] = int(v2s[lane]);
+        record.v[3] = int(v3s[lane]);
+      }
+    }
+    generate_as<SceneConfig::Placement::Uniform, false>(i, end, out + (i - begin));
+  }
+
+#endif
+
+  template<SceneConfig::Placement placement>
+  void place(std::uint64_t r, int& x, int& y) const{
+    const SceneConfig& c = _config;
+    if(placement == SceneConfig::Placement::Clustered){
+      // Sum of two uniforms: a cheap bell shape around the centre
+      const Centre& centre = _centres[scale(r >> 32, int(_centres.size()))];
+      int diameter = 2 * c.cluster_radius + 1;
+      std::uint64_t u = Random::mix(r), v = Random::mix(u);
+      x = centre.x - c.cluster_radius + (scale(u >> 32, diameter) + scale(u, diameter)) / 2;
+      y = centre.y - c.cluster_radius + (scale(v >> 32, diameter) + scale(v, diameter)) / 2;
+    } else if(placement == SceneConfig::Placement::Zipf){
+      const ZipfSlot& slot = _zipf[scale(r >> 32, int(_zipf.size()))];
+      std::uint32_t cell = std::uint32_t(r) < slot.threshold ? slot.cell : slot.alias;
+      int cell_w = std::max<int>(1, c.width / int(c.zipf_grid));
+      int cell_h = std::max<int>(1, c.height / int(c.zipf_grid));
+      std::uint64_t inside = Random::mix(r);
+      x = int(cell % c.zipf_grid) * cell_w + scale(inside >> 32, cell_w);
+      y = int(cell / c.zipf_grid) * cell_h + scale(inside, cell_h);
+    } else{
+      x = scale(r >> 32, c.width);
+      y = scale(r, c.height);
+    }
+  }
+
+  template<bool exponential>
+  int size(std::uint32_t bits) const{
+    const SceneConfig& c = _config;
+    if(exponential){
+      double size = -std::log((double(bits) + 1.0) / 4294967296.0) * c.mean_size;
+      return std::max(c.min_size, std::min(c.max_size, int(size)));
+    }
+    return c.min_size + scale(bits, c.max_size - c.min_size + 1);
+  }
+
+  struct ZipfSlot{
+    std::uint32_t threshold, cell, alias;
+  };
+
+  SceneConfig _config;
+  std::uint32_t _point_threshold, _line_threshold;
+  std::vector<Centre> _centres;
+  std::vector<ZipfSlot> _zipf;
+};
+
+// --------------------------------------------------
+// Dirty set
+//
+// One bit per element handle, set when the element changes, so
+// caches and indexes can refresh just those elements.
+// --------------------------------------------------
+
+class DirtySet{
+public:
+  std::size_t size() const{
+    return _size;
+  }
+
+  // Grow or shrink; new bits start clear
+  void resize(std::size_t size){
+    _words.resize((size + 63) / 64, 0);
+    if(size < _size && size % 64 != 0){
+      _words.back() &= (std::uint64_t{1} << (size % 64)) - 1;
+    }
+    _size = size;
+  }
+
+  void set(std::size_t i){
+    if(i >= _size){
+      resize(i + 1);
+    }
+    _words[i / 64] |= std::uint64_t{1} << (i % 64);
+  }
+
+  bool test(std::size_t i) const{
+    return i < _size && (_words[i / 64] >> (i % 64)) & 1;
+  }
+
+  void clear(){
+    std::fill(_words.begin(), _words.end(), 0);
+  }
+
+  void set_all(){
+    std::fill(_words.begin(), _words.end(), ~std::uint64_t{0});
+    if(_size % 64 != 0){
+      _words.back() &= (std::uint64_t{1} << (_size % 64)) - 1; // None past the end
+    }
+  }
+
+  bool empty() const{
+    return std::all_of(_words.begin(), _words.end(), [](std::uint64_t word){ return word == 0; });
+  }
+
+  std::size_t count() const{
+    std::size_t count = 0;
+    for(std::uint64_t word: _words){
+      count += __builtin_popcountll(word);
+    }
+    return count;
+  }
+
+  // Calls f(i) for every set bit, in increasing order; skips clear
+  // words 64 bits at a time
+  template<typename F>
+  void for_each(F&& f) const{
+    for(std::size_t w = 0; w < _words.size(); ++w){
+      for(std::uint64_t word = _words[w]; word != 0; word &= word - 1){
+        f(w * 64 + __builtin_ctzll(word));
+      }
+    }
+  }
+
+private:
+  std::vector<std::uint64_t> _words;
+  std::size_t _size{0};
+};
+
+// --------------------------------------------------
+// Element attributes
+//
+// Names, styles and metadata are rarely read next to geometry, so
+// they don't live in the elements: scans over elements (and their
+// geometry columns) would drag them through the cache for nothing.
+// A Drawing keeps them in a side table keyed by element handle,
+// holding entries only for elements that have any.
+// --------------------------------------------------
+
+struct ElementAttributes{
+  std::string   name;
+  std::uint32_t stroke_color{0x000000FF}; // RGBA
+  std::uint32_t fill_color{0};
+  float         stroke_width{1};
+  std::map<std::string, std::string> metadata;
+};
+
+class AttributeTable{
+public:
+  // Attributes of `handle`, created with defaults on first use
+  ElementAttributes& operator[](ElementHandle handle){
+    return _attributes[handle];
+  }
+
+  // Null if `handle` has none
+  const ElementAttributes* find(ElementHandle handle) const{
+    auto found = _attributes.find(handle);
+    return found == _attributes.end() ? nullptr : &found->second;
+  }
+
+  void erase(ElementHandle handle){
+    _attributes.erase(handle);
+  }
+
+  void clear(){
+    _attributes.clear();
+  }
+
+  std::size_t size() const{
+    return _attributes.size();
+  }
+
+  // Follow elements that moved: `new_handle[old]` is where each one
+  // went, or `dropped` if it's gone
+  void remap(const std::vector<ElementHandle>& new_handle, ElementHandle dropped){
+    std::map<ElementHandle, ElementAttributes> moved;
+    for(auto& entry: _attributes){
+      if(entry.first < new_handle.size() && new_handle[entry.first] != dropped){
+        moved.emplace(new_handle[entry.first], std::move(entry.second));
+      }
+    }
+    _attributes.swap(moved);
+  }
+
+private:
+  std::map<ElementHandle, ElementAttributes> _attributes;
+};
+
+// --------------------------------------------------
+// Change notifications
+//
+// Observers of a Drawing receive its changes in batches, as one
+// contiguous array of records per call, rather than one call per
+// mutation. Several changes to one element within a batch are
+// folded into the first record for it.
+// --------------------------------------------------
+
+struct ChangeRecord{
+  enum class Kind : unsigned char{
+    Added,     // Element `handle` was added
+    Updated,   // Element `handle` was changed in place
+    Cleared,   // All elements were removed
+    Reordered, // Elements were reordered; handles changed
+    Moved,     // Every element was translated; handles unchanged
+    Removed,   // Element `handle` was removed, leaving a hole
+    Compacted, // Holes were squeezed out; see Drawing::compaction_map()
+    Reset      // The drawing was rebuilt (recovery); handles changed
+  };
+
+  Kind kind;
+  ElementHandle handle;
+};
+
+class DrawingObserver{
+public:
+  virtual ~DrawingObserver(){}
+
+  // `count` changes in the order they happened; the array is only
+  // valid during the call
+  virtual void on_changes(const ChangeRecord* changes, std::size_t count)=0;
+};
+
+// --------------------------------------------------
+// Write-ahead log
+//
+// Every mutation of a Drawing is appended to a log file as a
+// fixed-size entry. Entries are not fsync'ed one by one: a
+// flusher thread writes whatever has queued up and syncs it
+// in one go (group commit), either when `max_batch` entries
+// are waiting or when the oldest one has waited `sync_interval`.
+//
+// Smaller intervals mean lower commit latency, larger ones mean
+// more entries per fsync. With `wait_for_sync` set, append()
+// only returns once its entry is on disk.
+// --------------------------------------------------
+
+struct LogOptions{
+  std::chrono::milliseconds sync_interval{10};
+  std::size_t max_batch{1024};
+  bool wait_for_sync{false};
+};
+
+class DrawingLog{
+public:
+  // What happened to the drawing. Generation marks the start of a
+  // checkpoint and of the log truncated after it (number in `handle`).
+  enum class Op : unsigned char { AddPtr, AddUPtr, ClearPtrs, ClearUPtrs, SortByLayer, Update, Translate, Remove, Compact,
+                                  Generation };
+
+  // On-disk entry; the checksum lets replay detect a torn tail
+  struct Entry{
+    Op            op;
+    ElementType   type;
+    std::int16_t  layer;
+    std::int32_t  v[4];
+    std::uint32_t handle; // Element updated or removed, for Update and Remove
+    std::uint32_t checksum;
+  };
+
+  struct Stats{
+    std::uint64_t entries{0};
+    std::uint64_t syncs{0};
+    std::chrono::microseconds max_commit_latency{0};
+
+    double entries_per_sync() const{
+      return syncs == 0 ? 0.0 : double(entries) / double(syncs);
+    }
+  };
+
+  DrawingLog(const std::string& path, LogOptions options = {}):
+    _options(options){
+    // Carry on from the generation of an existing log
+    replay(path, [this](const Entry& entry){
+      if(entry.op == Op::Generation){
+        _generation = entry.handle;
+      }
+    });
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(_fd < 0){
+      throw std::runtime_error{"Cannot open log file " + path};
+    }
+    _flusher = std::thread{[this]{ flush_loop(); }};
+  }
+
+  ~DrawingLog(){
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      _stopping = true;
+    }
+    _wake.notify_one();
+    _flusher.join();
+    ::close(_fd);
+  }
+
+  DrawingLog(const DrawingLog&) = delete;
+  DrawingLog& operator=(const DrawingLog&) = delete;
+
+  // Queue an entry for the next group commit. Throws once a write
+  // has failed, since the log can't be replayed past the lost entries.
+  void append(Op op, const ElementRecord& record = {}, ElementHandle handle = 0){
+    Entry entry = make_entry(op, record, handle);
+
+    std::unique_lock<std::mutex> lock{_mutex};
+    std::uint64_t sequence = enqueue(entry);
+    if(_options.wait_for_sync){
+      _synced.wait(lock, [&]{ return _durable >= sequence || _failed; });
+      check_failed();
+    }
+  }
+
+  // Block until everything appended so far is on disk; throws if
+  // a write failed instead
+  void sync(){
+    std::unique_lock<std::mutex> lock{_mutex};
+    std::uint64_t sequence = _appended;
+    _flush_requested = true;
+    _wake.notify_one();
+    _synced.wait(lock, [&]{ return _durable >= sequence || _failed; });
+    check_failed();
+  }
+
+  // Generation of the entries being appended
+  std::uint32_t generation() const{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _generation;
+  }
+
+  // Start `generation` with a marker entry; entries appended after
+  // it belong to the generation. A checkpoint calls this as it takes
+  // its snapshot, so the log holds everything the snapshot misses
+  // from the marker on, whether or not truncate() gets to run.
+  void begin_generation(std::uint32_t generation){
+    std::lock_guard<std::mutex> lock{_mutex};
+    _generation_begin = enqueue(make_entry(Op::Generation, {}, generation));
+    _generation = generation;
+  }
+
+  // Drop the entries before the current generation, once its
+  // checkpoint is durable. The lock is held from the drain through
+  // the truncation, so nothing can be appended in between; if
+  // anything was appended after the marker, the file is left as it
+  // is, since recovery skips what comes before the marker anyway.
+  void truncate(){
+    std::unique_lock<std::mutex> lock{_mutex};
+    _flush_requested = true;
+    _wake.notify_one();
+    _synced.wait(lock, [&]{ return _durable >= _appended || _failed; });
+    check_failed();
+    if(_appended != _generation_begin){
+      return;
+    }
+    Entry marker = make_entry(Op::Generation, {}, _generation);
+    if(::ftruncate(_fd, 0) != 0 || !write_all(_fd, &marker, sizeof(marker)) || ::fsync(_fd) != 0){
+      throw std::runtime_error{"Cannot truncate log file"};
+    }
+  }
+
+  Stats stats() const{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _stats;
+  }
+
+  // Write a sequence of entries to `path` and make them durable,
+  // replacing the file atomically (used for checkpoints). The rename
+  // is made durable too, by syncing the directory, before this
+  // returns and the log can be truncated.
+  static void write_file(const std::string& path, const std::vector<Entry>& entries){
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+      throw std::runtime_error{"Cannot open checkpoint file " + tmp_path};
+    }
+    bool ok = write_all(fd, entries.data(), entries.size() * sizeof(Entry)) && ::fsync(fd) == 0;
+    ::close(fd);
+    if(!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0 || !sync_directory(path)){
+      throw std::runtime_error{"Cannot write checkpoint file " + path};
+    }
+  }
+
+  // Feed every intact entry of `path` to `apply`; stops at the
+  // first torn or corrupt entry. A missing file replays nothing.
+  template<typename Apply>
+  static std::size_t replay(const std::string& path, Apply&& apply){
+    std::ifstream in{path, std::ios::binary};
+    std::size_t count = 0;
+    Entry entry;
+    while(in.read(reinterpret_cast<char*>(&entry), sizeof(entry))){
+      if(entry.checksum != checksum(entry)){
+        break;
+      }
+      apply(entry);
+      ++count;
+    }
+    return count;
+  }
+
+  static Entry make_entry(Op op, const ElementRecord& record, ElementHandle handle = 0){
+    Entry entry{};
+    entry.op     = op;
+    entry.handle = std::uint32_t(handle);
+    entry.type  = record.type;
+    entry.layer = record.layer;
+    for(int i = 0; i < 4; ++i){
+      entry.v[i] = record.v[i];
+    }
+    entry.checksum = checksum(entry);
+    return entry;
+  }
+
+private:
+
+  // FNV-1a over everything but the checksum itself
+  static std::uint32_t checksum(const Entry& entry){
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&entry);
+    std::uint32_t hash = 2166136261u;
+    for(std::size_t i = 0; i < offsetof(Entry, checksum); ++i){
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+  }
+
+  // Queue `entry`, with the lock held; its sequence number
+  std::uint64_t enqueue(const Entry& entry){
+    check_failed();
+    if(_pending.empty()){
+      _oldest_pending = std::chrono::steady_clock::now();
+    }
+    _pending.push_back(entry);
+    if(_pending.size() >= _options.max_batch || _options.sync_interval.count() == 0){
+      _wake.notify_one();
+    }
+    return ++_appended;
+  }
+
+  // fsync the directory holding `path`, so that a rename in it lasts
+  static bool sync_directory(const std::string& path){
+    std::size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0){
+      return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+  }
+
+  void check_failed() const{
+    if(_failed){
+      throw std::runtime_error{"Write-ahead log: a write failed; entries since are not durable"};
+    }
+  }
+
+  static bool write_all(int fd, const void* data, std::size_t size){
+    const char* bytes = static_cast<const char*>(data);
+    while(size > 0){
+      ssize_t written = ::write(fd, bytes, size);
+      if(written < 0){
+        return false;
+      }
+      bytes += written;
+      size  -= written;
+    }
+    return true;
+  }
+
+  void flush_loop(){
+    std::vector<Entry> batch;
+    std::unique_lock<std::mutex> lock{_mutex};
+    while(true){
+      // Sleep until a batch is full, the oldest entry is due, or someone asks
+      auto due = [&]{
+        return _stopping || _flush_requested
+          || _pending.size() >= _options.max_batch
+          || (!_pending.empty()
+              && std::chrono::steady_clock::now() >= _oldest_pending + _options.sync_interval);
+      };
+      if(_pending.empty()){
+        _wake.wait(lock, due);
+      } else{
+        _wake.wait_until(lock, _oldest_pending + _options.sync_interval, due);
+      }
+      if(_pending.empty()){
+        _flush_requested = false;
+        _synced.notify_all();
+        if(_stopping){
+          return;
+        }
+        continue;
+      }
+
+      batch.swap(_pending);
+      std::uint64_t sequence = _appended;
+      auto oldest = _oldest_pending;
+      _flush_requested = false;
+
+      // Write and sync without holding the lock, so appends can go on.
+      // After a failure nothing more is written: entries past a gap
+      // would replay onto the wrong state.
+      bool failed = _failed;
+      lock.unlock();
+      bool ok = !failed && write_all(_fd, batch.data(), batch.size() * sizeof(Entry)) && ::fdatasync(_fd) == 0;
+      auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - oldest);
+      lock.lock();
+
+      if(ok){
+        _stats.entries += batch.size();
+        _stats.syncs   += 1;
+        if(latency > _stats.max_commit_latency){
+          _stats.max_commit_latency = latency;
+        }
+        _durable = sequence;
+      } else{
+        _failed = true;
+      }
+      batch.clear();
+      _synced.notify_all();
+    }
+  }
+
+  LogOptions _options;
+  int _fd;
+
+  mutable std::mutex _mutex;
+  std::condition_variable _wake;   // wakes the flusher
+  std::condition_variable _synced; // wakes writers waiting for durability
+  std::vector<Entry> _pending;
+  std::chrono::steady_clock::time_point _oldest_pending;
+  std::uint64_t _appended{0};
+  std::uint64_t _durable{0};
+  std::uint32_t _generation{0};
+  std::uint64_t _generation_begin{0}; // Sequence of its marker
+  bool _failed{false}; // A write failed; _durable stays where it was
+  bool _flush_requested{false};
+  bool _stopping{false};
+  Stats _stats;
+
+  std::thread _flusher;
+};
+
+// --------------------------------------------------
+// Shared memory
+//
+// A Drawing can mirror its unique pointer collection into a POSIX
+// shared-memory segment, so other processes on the host can map
+// and render it read-only without copying. Elements themselves
+// can't be shared (their vtable pointers only mean something in
+// this process), so the segment holds ElementRecords: a header,
+// then the records at an offset from the start of the segment.
+// Nothing in it is a pointer, so every process may map it at a
+// different address.
+//
+// The writer updates the segment in place, bracketed by a
+// sequence number that is odd while an update is under way.
+// Readers check it before and after looking at the records and
+// retry if it moved (a seqlock), so they never block the writer.
+// --------------------------------------------------
+
+struct SharedDrawingHeader{
+  static constexpr std::uint32_t magic_value = 0x50545244; // "PTRD"
+  static constexpr std::uint32_t version_value = 1;
+
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::atomic<std::uint64_t> sequence; // Odd while the writer is updating
+  std::atomic<std::uint64_t> count;    // Records in use
+  std::atomic<std::uint64_t> capacity; // Records the segment has room for
+  std::uint64_t records_offset;        // From the start of the segment
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "The shared header needs address-free atomics");
+
+// A mapped shared-memory segment, unmapped and closed on destruction
+class SharedSegment{
+public:
+  SharedSegment(){}
+
+  ~SharedSegment(){
+    unmap();
+    if(_fd >= 0){
+      ::close(_fd);
+    }
+  }
+
+  SharedSegment(const SharedSegment&) = delete;
+  SharedSegment& operator=(const SharedSegment&) = delete;
+
+  // Create `name` (e.g. "/drawing"), replacing any old segment
+  void create(const std::string& name, std::size_t size){
+    _fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_fd < 0){
+      throw std::runtime_error{"Cannot create shared memory " + name};
+    }
+    _writable = true;
+    resize(size);
+  }
+
+  // Map an existing segment read-only, at its current size
+  void open(const std::string& name){
+    _fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if(_fd < 0){
+      throw std::runtime_error{"Cannot open shared memory " + name};
+    }
+    remap();
+  }
+
+  // Writer only: change the size of the segment and map all of it
+  void resize(std::size_t size){
+    if(::ftruncate(_fd, off_t(size)) != 0){
+      throw std::runtime_error{"Cannot resize shared memory"};
+    }
+    remap();
+  }
+
+  // Map the segment again at its current size, after the writer grew it
+  void remap(){
+    struct stat info;
+    if(::fstat(_fd, &info) != 0){
+      throw std::runtime_error{"Cannot stat shared memory"};
+    }
+    unmap();
+    int protection = _writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* data = ::mmap(nullptr, std::size_t(info.st_size), protection, MAP_SHARED, _fd, 0);
+    if(data == MAP_FAILED){
+      throw std::runtime_error{"Cannot map shared memory"};
+    }
+    _data = static_cast<char*>(data);
+    _size = std::size_t(info.st_size);
+  }
+
+  char* data() const{ return _data; }
+  std::size_t size() const{ return _size; }
+
+private:
+  void unmap(){
+    if(_data != nullptr){
+      ::munmap(_data, _size);
+      _data = nullptr;
+    }
+  }
+
+  int _fd{-1};
+  bool _writable{false};
+  char* _data{nullptr};
+  std::size_t _size{0};
+};
+
+// Writer side; the segment is removed when this goes away
+class SharedDrawing{
+public:
+  explicit SharedDrawing(const std::string& name, std::size_t capacity = 1024):
+    _name(name){
+    _segment.create(name, records_offset + capacity * sizeof(ElementRecord));
+    SharedDrawingHeader* h = new(_segment.data()) SharedDrawingHeader{};
+    h->magic   = SharedDrawingHeader::magic_value;
+    h->version = SharedDrawingHeader::version_value;
+    h->records_offset = records_offset;
+    h->capacity.store(capacity, std::memory_order_release);
+  }
+
+  ~SharedDrawing(){
+    ::shm_unlink(_name.c_str());
+  }
+
+  SharedDrawing(const SharedDrawing&) = delete;
+  SharedDrawing& operator=(const SharedDrawing&) = delete;
+
+  const std::string& name() const{
+    return _name;
+  }
+
+  // Start an update; readers retry until end_update()
+  void begin_update(){
+    header().sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  void end_update(){
+    header().sequence.fetch_add(1, std::memory_order_release);
+  }
+
+  // Make room for `count` records, growing the segment by at least
+  // half so that appends stay cheap. Only during an update.
+  void reserve(std::size_t count){
+    std::size_t capacity = header().capacity.load(std::memory_order_relaxed);
+    if(count <= capacity){
+      return;
+    }
+    capacity = std::max(count, capacity + capacity / 2);
+    _segment.resize(records_offset + capacity * sizeof(ElementRecord));
+    header().capacity.store(capacity, std::memory_order_relaxed);
+  }
+
+  void set_count(std::size_t count){
+    header().count.store(count, std::memory_order_relaxed);
+  }
+
+  ElementRecord* records(){
+    return reinterpret_cast<ElementRecord*>(_segment.data() + records_offset);
+  }
+
+private:
+  // Records start on their own cache line
+  static constexpr std::size_t records_offset = 64;
+  static_assert(sizeof(SharedDrawingHeader) <= records_offset, "Header overlaps the records");
+
+  SharedDrawingHeader& header(){
+    return *reinterpret_cast<SharedDrawingHeader*>(_segment.data());
+  }
+
+  std::string _name;
+  SharedSegment _segment;
+};
+
+// Reader side: maps a drawing shared by another process read-only
+class SharedDrawingView{
+public:
+  explicit SharedDrawingView(const std::string& name){
+    _segment.open(name);
+    if(_segment.size() < sizeof(SharedDrawingHeader)
+       || header().magic != SharedDrawingHeader::magic_value
+       || header().version != SharedDrawingHeader::version_value){
+      throw std::runtime_error{"Not a shared drawing: " + name};
+    }
+  }
+
+  // How long one update may take before the writer is taken for dead
+  static constexpr std::chrono::milliseconds writer_timeout{1000};
+
+  // Call read(const ElementRecord* records, std::size_t count) on a
+  // consistent snapshot, straight from the shared pages. `read` is
+  // called again if the writer changed the drawing meanwhile, so it
+  // must not keep the pointer or act on the records until it returns.
+  // Throws if an update stays unfinished for writer_timeout, as when
+  // the writer died in the middle of one.
+  template<typename Read>
+  void read(Read&& read){
+    std::uint64_t waiting_on = 0; // Odd sequence of the update being waited for
+    std::chrono::steady_clock::time_point since;
+    while(true){
+      const SharedDrawingHeader& h = header();
+      std::uint64_t sequence = h.sequence.load(std::memory_order_acquire);
+      if(sequence % 2 != 0){
+        auto now = std::chrono::steady_clock::now();
+        if(sequence != waiting_on){
+          waiting_on = sequence;
+          since      = now;
+        } else if(now - since > writer_timeout){
+          throw std::runtime_error{"Shared drawing: the writer stopped in the middle of an update"};
+        }
+        std::this_thread::yield();
+        continue;
+      }
+      std::size_t count = h.count.load(std::memory_order_relaxed);
+      if(h.records_offset + count * sizeof(ElementRecord) > _segment.size()){
+        _segment.remap(); // The writer grew the segment
+        continue;
+      }
+      read(reinterpret_cast<const ElementRecord*>(_segment.data() + h.records_offset), count);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(h.sequence.load(std::memory_order_relaxed) == sequence){
+        return;
+      }
+    }
+  }
+
+  // Number of elements at the time of the call
+  std::size_t size(){
+    std::size_t size = 0;
+    read([&](const ElementRecord*, std::size_t count){ size = count; });
+    return size;
+  }
+
+  // Render a snapshot straight from the shared pages. Output goes
+  // to a buffer first, so a retried read doesn't print twice.
+  void render(){
+    std::ostringstream frame;
+    {
+      CoutRedirect redirect{frame.rdbuf()};
+      read([&](const ElementRecord* records, std::size_t count){
+        frame.str("");
+        std::cout << std::endl;
+        std::cout << "Rendering " << count << " elements from shared memory" << std::endl;
+        for(std::size_t i = 0; i < count; ++i){
+          render_record(records[i]);
+        }
+      });
+    }
+    std::cout << frame.str() << std::flush;
+  }
+
+private:
+  const SharedDrawingHeader& header() const{
+    return *reinterpret_cast<const SharedDrawingHeader*>(_segment.data());
+  }
+
+  SharedSegment _segment;
+};
+
+// Drawing, which contains a collection of elements
+// representing small parts that make up a single drawing
+class Drawing{
+public:
+  Drawing(){}
+
+  // Allocate elements from `pool`, shared with other drawings; they
+  // are all released together when the drawing is destroyed
+  explicit Drawing(ElementPool& pool): _arena(new ElementArena{pool}){}
+
+  ~Drawing(){
+    // Tearing down is not a mutation worth logging
+    _log.reset();
+    clear_drawing_ptrs();
+  }
+
+  // --------------------------------------------------
+  /* !! This will throw a compilation error: 
+     
+     "cannot declare parameter 'element' to be of
+      abstract type 'DrawingElement'"
+  */
+
+  // Add drawing element to collection
+  // void add_element(DrawingElement element){
+  //   _drawing.push_back(element);
+  // }
+  // --------------------------------------------------
+
+  // Add drawing element pointer to collection
+  void add_element_ptr(DrawingElement* element_ptr){
+    TRACE_SCOPE("Drawing::add_element_ptr");
+    if(element_ptr != nullptr){
+      record_mutation(DrawingLog::Op::AddPtr, element_ptr);
+    }
+    _drawing_ptrs.push_back(element_ptr);
+  }
+
+  // Add drawing element unique pointer to collection
+  ElementHandle add_element_u_ptr(std::unique_ptr<DrawingElement> element_u_ptr){
+    TRACE_SCOPE("Drawing::add_element_u_ptr");
+
+    // This will not work, because vector tries
+    // to *copy* a unique pointer.
+    // _drawing_u_ptrs.emplace_back(elementUPtr);
+
+    // Unique pointers must be moved
+    ElementHandle handle = _drawing_u_ptrs.size();
+    record_mutation(DrawingLog::Op::AddUPtr, element_u_ptr.get(), handle);
+    _drawing_u_ptrs.emplace_back(std::move(element_u_ptr));
+    return handle;
+  }
+  
+  // Add many elements to the unique pointer collection at once;
+  // the elements are constructed in parallel
+  void add_elements(const std::vector<ElementRecord>& records){
+    TRACE_SCOPE("Drawing::add_elements");
+    std::size_t first = _drawing_u_ptrs.size();
+    _drawing_u_ptrs.resize(first + records.size());
+    parallel_for(records.size(), [&](std::size_t, std::size_t begin, std::size_t end){
+      ArenaScope scope{_arena.get()};
+      for(std::size_t i = begin; i < end; ++i){
+        _drawing_u_ptrs[first + i] = make_element(records[i]);
+      }
+    });
+    for(std::size_t i = first; i < _drawing_u_ptrs.size(); ++i){
+      record_mutation(DrawingLog::Op::AddUPtr, _drawing_u_ptrs[i].get(), i);
+    }
+  }
+
+  // Create an element in this drawing's arena (or on the heap if
+  // it has none), ready for add_element_u_ptr()
+  template<typename Element, typename... Args>
+  std::unique_ptr<Element> make(Args&&... args){
+    ArenaScope scope{_arena.get()};
+    return std::unique_ptr<Element>{new Element{std::forward<Args>(args)...}};
+  }
+
+  // Memory taken from the pools by this drawing, including its NUMA
+  // and retired arenas; all zero without any
+  ElementArena::Stats memory() const{
+    ElementArena::Stats total{0, 0, 0};
+    auto add = [&](const std::unique_ptr<ElementArena>& arena){
+      if(arena){
+        ElementArena::Stats stats = arena->stats();
+        total.live_elements  += stats.live_elements;
+        total.blocks         += stats.blocks;
+        total.bytes_reserved += stats.bytes_reserved;
+      }
+    };
+    add(_arena);
+    for(auto& arena: _node_arenas){
+      add(arena);
+    }
+    for(auto& arena: _retired_arenas){
+      add(arena);
+    }
+    return total;
+  }
+
+  // --------------------------------------------------
+  // This throws a compilation error
+  //
+  // Rendering from collection of DrawingElement objects
+  // void render(){
+  //   for(auto element: _drawing){
+  //     element.render();
+  //   }
+  // }
+  // --------------------------------------------------
+
+  // Rendering from collection of pointers to DrawingElement
+  void render_ptrs(){
+    TRACE_SCOPE("Drawing::render_ptrs");
+    std::cout << std::endl;
+
+    if(_drawing_ptrs.empty()){
+      std::cout << "Collection of pointers is empty" << std::endl;
+      return;
+    }
+    
+    std::cout << "Rendering " << _drawing_ptrs.size() << " elements from pointers" << std::endl;
+    for(std::size_t i = 0; i < _drawing_ptrs.size(); ++i){
+      prefetch_ahead(_drawing_ptrs, i, _prefetch_distance);
+      DrawingElement* element_ptr = _drawing_ptrs[i];
+      if(element_ptr == nullptr){
+        std::cout << "  ** Null pointer" << std::endl;
+      } else{
+        element_ptr->render();
+      }
+    }
+  }
+
+  // Rendering from collection of unique pointers to DrawingElement
+  void render_u_ptrs(){
+    TRACE_SCOPE("Drawing::render_u_ptrs");
+    std::cout << std::endl;
+    std::cout << "Rendering " << _drawing_u_ptrs.size() - _holes << " elements from unique pointers" << std::endl;
+
+    // Must dereference to be used
+    for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+      prefetch_ahead(_drawing_u_ptrs, i, _prefetch_distance);
+      if(auto& elementPtr = _drawing_u_ptrs[i]){ // Skip holes left by remove()
+        elementPtr->render();
+      }
+    }
+  }
+  
+  // Rendering from collection of unique pointers, dispatching on the
+  // type tag: the built-in classes are final, so calling render()
+  // through the concrete type is a direct call. Other classes still
+  // go through the vtable.
+  void render_tagged(){
+    TRACE_SCOPE("Drawing::render_tagged");
+    std::cout << std::endl;
+    std::cout << "Rendering " << _drawing_u_ptrs.size() - _holes << " elements by type tag" << std::endl;
+
+    for(auto& elementPtr: _drawing_u_ptrs){
+      if(elementPtr){
+        render_element(*elementPtr);
+      }
+    }
+  }
+
+  // Prefetch distance used by render_ptrs() and render_u_ptrs(), in
+  // elements; 0, the default, turns prefetching off. Set it, or
+  // calibrate it once the drawing is loaded.
+  std::size_t prefetch_distance() const{
+    return _prefetch_distance;
+  }
+
+  void set_prefetch_distance(std::size_t distance){
+    _prefetch_distance = distance;
+  }
+
+  // Time reading windows of the larger collection at each of a few
+  // distances and keep the fastest. The reads stand in for render(),
+  // without its output, which would swamp the misses being timed.
+  // The runs read disjoint windows, so none of them runs on elements
+  // already in cache (unless there are fewer elements than runs).
+  std::size_t calibrate_prefetch(){
+    TRACE_SCOPE("Drawing::calibrate_prefetch");
+    if(_drawing_ptrs.size() > _drawing_u_ptrs.size()){
+      calibrate_prefetch(_drawing_ptrs);
+    } else{
+      calibrate_prefetch(_drawing_u_ptrs);
+    }
+    return _prefetch_distance;
+  }
+
+  // Factory Methods ------------------------------
+  
+  static std::unique_ptr<Point> getPointPtr(int x, int y){
+    return std::unique_ptr<Point>{new Point{x, y}};
+  }
+  
+  static std::unique_ptr<Line> getLinePtr(int x1, int y1, int x2, int y2){
+    return std::unique_ptr<Line>{new Line{x1, y1, x2, y2}};
+  }
+  
+  static std::unique_ptr<Rectangle> getRectanglePtr(int x, int y, int w, int h){
+    return std::unique_ptr<Rectangle>{new Rectangle{x, y, w, h}};
+  }
+
+  // -----------------------------------------------
+
+  // Draw some basic elements
+  void draw(){
+    TRACE_SCOPE("Drawing::draw");
+    _drawing.clear();
+
+    /* 
+       The following will give compilation error:
+
+         "invalid new-expression of abstract class type 'DrawingElement'"
+    */
+    // _drawing.push_back(Point{10, 15});
+    // _drawing.push_back(Line{25, 25, 50, 100});
+    // _drawing.push_back(Rectangle{50, 50, 100, 75}); 
+    // --------------------------------------------------
+
+    // We can create individual elements
+    Point      point{10, 15};
+    Line       line{25, 25, 50, 100};
+    Rectangle  rect{50, 50, 100, 75};
+
+    /*
+       But we can't insert them to the vector:
+
+         "invalid new-expression of abstract class type 'DrawingElement'"
+    */
+    // _drawing.push_back(point);
+    // _drawing.push_back(line);
+    // _drawing.push_back(rect);
+    // --------------------------------------------------
+  }
+
+  void draw_ptrs(){
+    TRACE_SCOPE("Drawing::draw_ptrs");
+    ArenaScope scope{_arena.get()};
+    record_mutation(DrawingLog::Op::ClearPtrs);
+    _drawing_ptrs.clear();
+
+    Point      point{10, 15};
+    Line       line{25, 25, 50, 100};
+    Rectangle  rect{50, 50, 100, 75};
+
+    // Adding pointers work, but as soon as we leave this scope
+    // the objects are destroyed. Calling render() from where
+    // draw_ptrs() was called will throw an exception at runtime:
+    //    "pure virtual method called"
+    // _drawing_ptrs.push_back(&point);
+    // _drawing_ptrs.push_back(&line);
+    // _drawing_ptrs.push_back(&rect);
+    // --------------------------------------------------
+
+    // We can use the `new` keyword, but we must remember
+    // to clear the allocated memory.
+    _drawing_ptrs.push_back(new Point{45, 55});
+    _drawing_ptrs.push_back(new Line{88, 98, 456, 987});
+    _drawing_ptrs.push_back(new Rectangle{879, 654, 123, 321});
+    for(auto ptr: _drawing_ptrs){
+      record_mutation(DrawingLog::Op::AddPtr, ptr);
+    }
+  }
+
+  // Clear pointers created with `new` keyword
+  void clear_drawing_ptrs(){
+    TRACE_SCOPE("Drawing::clear_drawing_ptrs");
+    std::cout << std::endl;
+    std::cout << "* Deleting pointers" << std::endl;
+    record_mutation(DrawingLog::Op::ClearPtrs);
+    for(auto ptr: _drawing_ptrs){
+      delete ptr;
+    }
+    _drawing_ptrs.clear();
+  }
+
+  void draw_u_ptrs(){
+    TRACE_SCOPE("Drawing::draw_u_ptrs");
+    ArenaScope scope{_arena.get()};
+    record_mutation(DrawingLog::Op::ClearUPtrs);
+    _drawing_u_ptrs.clear();
+    // directly pushing back to vector
+    _drawing_u_ptrs.push_back(std::make_unique<Point>(180, 185));
+
+    // allegedly, emplace_back assures that the pointer is moved, and not copied
+    _drawing_u_ptrs.emplace_back(std::make_unique<Point>(10, 15));
+    _drawing_u_ptrs.emplace_back(getPointPtr(35, 22));
+    for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+      record_mutation(DrawingLog::Op::AddUPtr, _drawing_u_ptrs[i].get(), i);
+    }
+
+    // Method call which uses std::move()
+    add_element_u_ptr(std::make_unique<Point>(1, 5));
+    add_element_u_ptr(std::make_unique<Line>(2, 3, 724, 1125));
+    add_element_u_ptr(std::make_unique<Rectangle>(2225, 4523, 1124, 1125));
+  }
+
+  // Layers ---------------------------------------
+
+  // Reorder both collections by (layer, type), keeping insertion
+  // order within each, so that rendering follows the layers.
+  // Null pointers are moved to the end.
+  void sort_by_layer(){
+    TRACE_SCOPE("Drawing::sort_by_layer");
+    record_mutation(DrawingLog::Op::SortByLayer);
+    sort_by_layer(_drawing_ptrs);
+    std::vector<ElementHandle> new_handle;
+    sort_by_layer(_drawing_u_ptrs, _attributes.size() > 0 ? &new_handle : nullptr);
+    if(!new_handle.empty()){
+      _attributes.remap(new_handle, removed_handle);
+    }
+  }
+
+  // Changes --------------------------------------
+
+  // Change element `handle` of the unique pointer collection in place:
+  //   drawing.update<Point>(handle, [](Point& p){ p.set_x(10); });
+  // `Element` is checked against the element's type tag.
+  template<typename Element = DrawingElement, typename Mutate>
+  void update(ElementHandle handle, Mutate&& mutate){
+    TRACE_SCOPE("Drawing::update");
+    DrawingElement* element = element_at(handle).get();
+    check_type<Element>(*element);
+    mutate(*static_cast<Element*>(element));
+    changed(handle, *element);
+  }
+
+  // Replace element `handle` with one made from `record`
+  void replace(ElementHandle handle, const ElementRecord& record){
+    TRACE_SCOPE("Drawing::replace");
+    ArenaScope scope{_arena.get()};
+    std::unique_ptr<DrawingElement>& slot = element_at(handle);
+    bool same_type = slot->tag() == static_cast<unsigned char>(record.type);
+    slot = make_element(record);
+    if(!same_type){
+      _columns_stale = true;
+    }
+    changed(handle, *slot);
+  }
+
+  // Removal -------------------------------------
+
+  // Destroy element `handle`, leaving a hole so that the other
+  // handles stay valid. Holes are skipped by every scan and squeezed
+  // out by compact(), which runs by itself once they pass the
+  // ratio set by set_compaction().
+  void remove(ElementHandle handle){
+    TRACE_SCOPE("Drawing::remove");
+    element_at(handle).reset();
+    _attributes.erase(handle);
+    record_mutation(DrawingLog::Op::Remove, nullptr, handle);
+    if(_holes >= _compaction.min_holes
+       && double(_holes) > _compaction.max_hole_ratio * double(_drawing_u_ptrs.size())){
+      compact();
+    }
+  }
+
+  struct CompactionOptions{
+    double max_hole_ratio{0.25};  // Compact once holes exceed this share of the slots
+    std::size_t min_holes{1024};  // ...and there are at least this many
+  };
+
+  void set_compaction(CompactionOptions options){
+    _compaction = options;
+  }
+
+  std::size_t holes() const{
+    return _holes;
+  }
+
+  // Squeeze the holes out of both collections in one pass, keeping
+  // the order of the remaining elements. Handles change: see
+  // compaction_map().
+  void compact(){
+    TRACE_SCOPE("Drawing::compact");
+    std::size_t n = _drawing_u_ptrs.size();
+    _compaction_map.resize(n);
+    std::size_t boundary = 0;
+    std::size_t live = 0;
+    for(std::size_t i = 0; i < n; ++i){
+      // NUMA ranges keep the elements they had
+      for(; boundary < _partition_begin.size() && _partition_begin[boundary] == i; ++boundary){
+        _partition_begin[boundary] = live;
+      }
+      if(_drawing_u_ptrs[i]){
+        _drawing_u_ptrs[live] = std::move(_drawing_u_ptrs[i]);
+        _compaction_map[i] = live++;
+      } else{
+        _compaction_map[i] = removed_handle;
+      }
+    }
+    for(; boundary < _partition_begin.size(); ++boundary){
+      _partition_begin[boundary] = std::min(_partition_begin[boundary], live);
+    }
+    _drawing_u_ptrs.resize(live);
+    _attributes.remap(_compaction_map, removed_handle);
+    _drawing_ptrs.erase(std::remove(_drawing_ptrs.begin(), _drawing_ptrs.end(), nullptr), _drawing_ptrs.end());
+    record_mutation(DrawingLog::Op::Compact);
+  }
+
+  // Defragmentation ------------------------------
+
+  // Cache behaviour of a traversal of the unique pointer collection,
+  // per element, around a defragment()
+  struct DefragmentReport{
+    double misses_before{-1}, misses_after{-1};      // LLC misses; -1 without hardware counters
+    double scattered_before{0}, scattered_after{0}; // Steps to a cache line other than the same or next one
+  };
+
+  // Move every element of the unique pointer collection, in handle
+  // order, into freshly allocated blocks, so that a traversal walks
+  // memory sequentially; the old blocks go back to the pool. A
+  // drawing that allocates from the heap is reallocated on the heap.
+  // With NUMA enabled each node's range is moved within its node.
+  // Elements of other classes can't be recreated and stay put.
+  DefragmentReport defragment(){
+    TRACE_SCOPE("Drawing::defragment");
+    DefragmentReport report;
+    measure_traversal(report.misses_before, report.scattered_before);
+
+    if(numa_enabled()){
+      const NumaTopology& topology = NumaTopology::get();
+      std::vector<std::unique_ptr<ElementArena>> old;
+      old.swap(_node_arenas);
+      for(std::size_t node = 0; node < old.size(); ++node){
+        _node_arenas.emplace_back(new ElementArena{topology.pool(node)});
+      }
+      // One thread per node, so each range is laid out in order
+      relocate_partitions(std::numeric_limits<std::size_t>::max());
+      for(auto& arena: old){
+        retire(std::move(arena));
+      }
+    } else{
+      std::unique_ptr<ElementArena> old = std::move(_arena);
+      if(old){
+        _arena.reset(new ElementArena{old->pool()});
+      }
+      // Every copy is made before any original is freed: on the heap,
+      // a copy made right after freeing its original would just take
+      // the same chunk, and the layout would stay as scattered
+      std::vector<std::unique_ptr<DrawingElement>> copies(_drawing_u_ptrs.size());
+      {
+        ArenaScope scope{_arena.get()}; // Null: the heap
+        for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+          const DrawingElement* element = _drawing_u_ptrs[i].get();
+          if(element && element->tag() != DrawingElement::extension_tag){
+            copies[i] = make_element(record_of(*element));
+          }
+        }
+      }
+      for(std::size_t i = 0; i < copies.size(); ++i){
+        if(copies[i]){
+          _drawing_u_ptrs[i].swap(copies[i]);
+        }
+      }
+      copies.clear(); // The originals, all together
+      retire(std::move(old));
+    }
+
+    measure_traversal(report.misses_after, report.scattered_after);
+    return report;
+  }
+
+  // Mapped to by compaction_map() for elements that were removed
+  static constexpr ElementHandle removed_handle = ~ElementHandle{0};
+
+  // Old handle -> new handle, for the last compact()
+  const std::vector<ElementHandle>& compaction_map() const{
+    return _compaction_map;
+  }
+
+  // Elements added, updated or removed since the last clear_changes()
+  const DirtySet& changed_elements() const{
+    return _dirty;
+  }
+
+  // True if handles were invalidated (clear, sort, recovery) since
+  // the last clear_changes(); consumers must then rebuild
+  bool structure_changed() const{
+    return _structure_changed;
+  }
+
+  void clear_changes(){
+    _dirty.clear();
+    _structure_changed = false;
+  }
+
+  // Observers ------------------------------------
+
+  // Changes are queued and delivered on flush_changes(), e.g. once
+  // per frame, or when the outermost ChangeBatch ends
+  void subscribe(DrawingObserver* observer){
+    _observers.push_back(observer);
+  }
+
+  void unsubscribe(DrawingObserver* observer){
+    _observers.erase(std::remove(_observers.begin(), _observers.end(), observer), _observers.end());
+  }
+
+  // Deliver the queued changes to every observer
+  void flush_changes(){
+    TRACE_SCOPE("Drawing::flush_changes");
+    if(_queued_changes.empty()){
+      return;
+    }
+    // Observers may change the drawing; those changes go in the next batch
+    std::vector<ChangeRecord> changes;
+    changes.swap(_queued_changes);
+    _queued_handles.resize(0);
+    // Observers may also subscribe or unsubscribe, so go over a copy.
+    // One that's been unsubscribed meanwhile may be gone; one that's
+    // new starts with the next batch.
+    std::vector<DrawingObserver*> observers = _observers;
+    for(DrawingObserver* observer: observers){
+      if(std::find(_observers.begin(), _observers.end(), observer) != _observers.end()){
+        observer->on_changes(changes.data(), changes.size());
+      }
+    }
+  }
+
+  // Groups the changes made during its lifetime into one delivery
+  class ChangeBatch{
+  public:
+    explicit ChangeBatch(Drawing& drawing): _drawing(drawing){
+      ++_drawing._batch_depth;
+    }
+    ~ChangeBatch(){
+      if(--_drawing._batch_depth == 0){
+        _drawing.flush_changes();
+      }
+    }
+    ChangeBatch(const ChangeBatch&) = delete;
+    ChangeBatch& operator=(const ChangeBatch&) = delete;
+  private:
+    Drawing& _drawing;
+  };
+
+  // Overlaps -------------------------------------
+
+  // A pair of overlapping elements, as indices into the unique
+  // pointer collection, first < second
+  struct Overlap{
+    std::size_t first, second;
+  };
+
+  // All pairs of overlapping elements. Sweep and prune: boxes are
+  // sorted by their left edge, so each element only meets the ones
+  // starting before its right edge; the exact test runs only on
+  // those whose boxes also overlap vertically.
+  std::vector<Overlap> find_overlaps() const{
+    return find_overlaps(1);
+  }
+
+  // Same, with the sweep split across worker threads
+  std::vector<Overlap> find_overlaps_parallel() const{
+    return find_overlaps(worker_count(_drawing_u_ptrs.size(), 1 << 12));
+  }
+
+  // Line intersections ---------------------------
+
+  // Stream every point where two or more Lines of the unique pointer
+  // collection meet, as report(const IntersectionPoint&, const
+  // std::vector<std::size_t>& indices), without buffering them
+  template<typename Report>
+  void find_line_intersections(Report&& report) const{
+    TRACE_SCOPE("Drawing::find_line_intersections");
+    std::vector<SegmentSweep::Segment> segments;
+    for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+      if(!_drawing_u_ptrs[i]){
+        continue;
+      }
+      ElementRecord record = record_of(*_drawing_u_ptrs[i]);
+      if(record.type == ElementType::Line){
+        const int* v = record.v;
+        segments.push_back({v[0], v[1], v[2], v[3], i});
+      }
+    }
+    SegmentSweep{std::move(segments)}.run(report);
+  }
+
+  // Statistics -----------------------------------
+
+  // Counts, area, length, extent and centroid in one pass over the
+  // geometry columns; the columns are only rebuilt after a mutation
+  DrawingStats stats() const{
+    TRACE_SCOPE("Drawing::stats");
+    return compute_stats(columns());
+  }
+
+  // Culling --------------------------------------
+
+  // Handles of the elements of the unique pointer collection whose
+  // bounding box meets `viewport`, in increasing order. Scans the
+  // geometry columns only; the elements themselves aren't touched.
+  std::vector<ElementHandle> cull(const Bounds& viewport) const{
+    TRACE_SCOPE("Drawing::cull");
+    const GeometryColumns& c = columns();
+    std::vector<ElementHandle> handles;
+    std::size_t hits[3] = {0, 0, 0}; // Per type; they come points first, then lines, then rectangles
+    c.cull(viewport, [&](ElementType type, std::size_t i){
+      handles.push_back(c.handle(type, i));
+      ++hits[static_cast<int>(type)];
+    });
+    // Each type's hits are in handle order already
+    auto lines = handles.begin() + hits[0], rects = lines + hits[1];
+    std::inplace_merge(handles.begin(), lines, rects);
+    std::inplace_merge(handles.begin(), rects, handles.end());
+    return handles;
+  }
+
+  // The lines of the unique pointer collection that show in
+  // `viewport`, clipped to it, in handle order
+  ClippedLines clipped_lines(const Bounds& viewport) const{
+    TRACE_SCOPE("Drawing::clipped_lines");
+    ClippedLines lines;
+    clip_lines(columns(), viewport, lines);
+    return lines;
+  }
+
+  // Draw the lines that show in `viewport` into `fb`, anti-aliased,
+  // the viewport stretched over the whole framebuffer
+  void rasterize_lines(Framebuffer& fb, const Bounds& viewport) const{
+    TRACE_SCOPE("Drawing::rasterize_lines");
+    ClippedLines& lines = clip_scratch();
+    clip_lines(columns(), viewport, lines);
+    double scale_x = (fb.width() - 1) / double(std::max(1LL, viewport.max_x - viewport.min_x));
+    double scale_y = (fb.height() - 1) / double(std::max(1LL, viewport.max_y - viewport.min_y));
+    for(std::size_t i = 0; i < lines.size(); ++i){
+      draw_line(fb, (lines.x1[i] - viewport.min_x) * scale_x, (lines.y1[i] - viewport.min_y) * scale_y,
+                    (lines.x2[i] - viewport.min_x) * scale_x, (lines.y2[i] - viewport.min_y) * scale_y);
+    }
+  }
+
+  // Redraw only the pixels of `fb` showing `region` of the drawing,
+  // such as the old and new bounds of an edited element, as they'd
+  // come out of a full rasterize_lines() (to within rounding).
+  // Returns those pixels, for MipChain::update().
+  Bounds rasterize_lines(Framebuffer& fb, const Bounds& viewport, const Bounds& region) const{
+    TRACE_SCOPE("Drawing::rasterize_lines");
+    double scale_x = (fb.width() - 1) / double(std::max(1LL, viewport.max_x - viewport.min_x));
+    double scale_y = (fb.height() - 1) / double(std::max(1LL, viewport.max_y - viewport.min_y));
+    // Wu's lines spread a pixel either side
+    Bounds pixels{
+      std::max(0LL, (long long)std::floor((region.min_x - viewport.min_x) * scale_x) - 1),
+      std::max(0LL, (long long)std::floor((region.min_y - viewport.min_y) * scale_y) - 1),
+      std::min(fb.width() - 1LL, (long long)std::ceil((region.max_x - viewport.min_x) * scale_x) + 1),
+      std::min(fb.height() - 1LL, (long long)std::ceil((region.max_y - viewport.min_y) * scale_y) + 1)};
+    if(pixels.min_x > pixels.max_x || pixels.min_y > pixels.max_y){
+      return pixels;
+    }
+
+    // Draw into a scratch framebuffer with a margin, so that where
+    // lines are cut at its edges (and drawn as endpoints) falls
+    // outside the pixels copied back
+    const int margin = 3;
+    int origin_x = int(pixels.min_x) - margin, origin_y = int(pixels.min_y) - margin;
+    Framebuffer scratch(int(pixels.max_x - pixels.min_x) + 1 + 2 * margin, int(pixels.max_y - pixels.min_y) + 1 + 2 * margin);
+    Bounds area{
+      std::max(viewport.min_x, viewport.min_x + (long long)std::floor((origin_x - 1) / scale_x)),
+      std::max(viewport.min_y, viewport.min_y + (long long)std::floor((origin_y - 1) / scale_y)),
+      std::min(viewport.max_x, viewport.min_x + (long long)std::ceil((origin_x + scratch.width()) / scale_x)),
+      std::min(viewport.max_y, viewport.min_y + (long long)std::ceil((origin_y + scratch.height()) / scale_y))};
+    ClippedLines& lines = clip_scratch();
+    clip_lines(columns(), area, lines);
+    for(std::size_t i = 0; i < lines.size(); ++i){
+      draw_line(scratch, (lines.x1[i] - viewport.min_x) * scale_x - origin_x, (lines.y1[i] - viewport.min_y) * scale_y - origin_y,
+                         (lines.x2[i] - viewport.min_x) * scale_x - origin_x, (lines.y2[i] - viewport.min_y) * scale_y - origin_y);
+    }
+    std::size_t width = std::size_t(pixels.max_x - pixels.min_x + 1);
+    for(long long y = pixels.min_y; y <= pixels.max_y; ++y){
+      std::memcpy(fb.data() + std::size_t(y) * fb.width() + pixels.min_x,
+                  scratch.data() + std::size_t(y - origin_y) * scratch.width() + margin, width);
+    }
+    return pixels;
+  }
+
+  // Render the elements that meet `viewport` as render_u_ptrs()
+  // would, in the same (layer) order, skipping the rest. They're
+  // found from the geometry columns; lines only if some of them is
+  // left after clipping to the viewport. The elements render
+  // themselves, so other classes come out as they should.
+  void render_visible(const Bounds& viewport){
+    TRACE_SCOPE("Drawing::render_visible");
+    const GeometryColumns& c = columns();
+    std::vector<ElementHandle> visible;
+    c.cull(viewport, [&](ElementType type, std::size_t i){
+      if(type != ElementType::Line){
+        visible.push_back(c.handle(type, i));
+      }
+    });
+    ClippedLines& lines = clip_scratch();
+    clip_lines(c, viewport, lines);
+    visible.insert(visible.end(), lines.handle.begin(), lines.handle.begin() + lines.size());
+    std::sort(visible.begin(), visible.end());
+    std::cout << std::endl;
+    std::cout << "Rendering " << visible.size() << " visible elements" << std::endl;
+    for(ElementHandle handle: visible){
+      render_element(*_drawing_u_ptrs[handle]);
+    }
+  }
+
+  // Attributes -----------------------------------
+
+  // Cold attributes of element `handle`, created with defaults on
+  // first use. They follow the element through sort_by_layer() and
+  // compact(), go with it on remove(), and aren't logged.
+  ElementAttributes& attributes(ElementHandle handle){
+    element_at(handle);
+    return _attributes[handle];
+  }
+
+  // Null if element `handle` has no attributes
+  const ElementAttributes* find_attributes(ElementHandle handle) const{
+    return _attributes.find(handle);
+  }
+
+  // Point index ----------------------------------
+
+  // k-d tree over all Points of the unique pointer collection and,
+  // optionally, line endpoints and rectangle corners
+  PointIndex build_point_index(bool include_vertices = false) const{
+    TRACE_SCOPE("Drawing::build_point_index");
+    std::vector<ElementRecord> elements = records();
+    std::vector<PointIndex::Entry> entries;
+    entries.reserve(elements.size());
+    for(std::size_t i = 0; i < elements.size(); ++i){
+      const int* v = elements[i].v;
+      switch(elements[i].type){
+      case ElementType::Point:
+        entries.push_back({v[0], v[1], i});
+        break;
+      case ElementType::Line:
+        if(include_vertices){
+          entries.push_back({v[0], v[1], i});
+          entries.push_back({v[2], v[3], i});
+        }
+        break;
+      case ElementType::Rectangle:
+        if(include_vertices){
+          entries.push_back({v[0], v[1], i});
+          long long right = (long long)v[0] + v[2], bottom = (long long)v[1] + v[3];
+          entries.push_back({right, v[1], i});
+          entries.push_back({v[0], bottom, i});
+          entries.push_back({right, bottom, i});
+        }
+        break;
+      }
+    }
+    return PointIndex{std::move(entries)};
+  }
+
+  // NUMA -----------------------------------------
+
+  // Spread the unique pointer collection over the NUMA nodes: each
+  // node owns a contiguous range of handles, whose elements are
+  // recreated by threads on that node so their memory is local.
+  // visit_partitioned() and translate() then run each range on its
+  // node. Elements added later belong to the last node until the
+  // next repartition(). On a single node this only changes arenas.
+  void enable_numa(){
+    const NumaTopology& topology = NumaTopology::get();
+    for(std::size_t node = _node_arenas.size(); node < topology.nodes(); ++node){
+      _node_arenas.emplace_back(new ElementArena{topology.pool(node)});
+    }
+    repartition();
+  }
+
+  bool numa_enabled() const{
+    return !_node_arenas.empty();
+  }
+
+  // Even ranges over the current elements, each moved to its node.
+  // Elements of other classes can't be recreated and stay put.
+  void repartition(){
+    TRACE_SCOPE("Drawing::repartition");
+    std::size_t nodes = _node_arenas.size();
+    std::size_t n = _drawing_u_ptrs.size();
+    _partition_begin.resize(nodes + 1);
+    for(std::size_t node = 0; node <= nodes; ++node){
+      _partition_begin[node] = n * node / nodes;
+    }
+    relocate_partitions(1 << 14);
+  }
+
+  // Call visit(const DrawingElement&, handle) for every element of
+  // the unique pointer collection, concurrently, each on the node
+  // holding it (or across all CPUs when NUMA isn't enabled)
+  template<typename Visit>
+  void visit_partitioned(Visit&& visit) const{
+    TRACE_SCOPE("Drawing::visit_partitioned");
+    numa_parallel_for(partitions(), [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t i = begin; i < end; ++i){
+        if(_drawing_u_ptrs[i]){
+          visit(static_cast<const DrawingElement&>(*_drawing_u_ptrs[i]), ElementHandle{i});
+        }
+      }
+    });
+  }
+
+  // Move every built-in element of the unique pointer collection by
+  // (dx, dy), in place, each node's range on that node
+  void translate(int dx, int dy){
+    TRACE_SCOPE("Drawing::translate");
+    numa_parallel_for(partitions(), [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t i = begin; i < end; ++i){
+        if(_drawing_u_ptrs[i]){
+          translate_element(*_drawing_u_ptrs[i], dx, dy);
+        }
+      }
+    });
+    if(!_columns_stale){
+      _columns.translate(dx, dy);
+    }
+    track_mutation(DrawingLog::Op::Translate);
+    if(_log){
+      _log->append(DrawingLog::Op::Translate, ElementRecord{ElementType::Point, 0, {dx, dy, 0, 0}}, 0);
+    }
+  }
+
+  // Shared memory --------------------------------
+
+  // Mirror the unique pointer collection into shared-memory segment
+  // `name` (e.g. "/drawing"), for SharedDrawingView in other
+  // processes. The segment is written by publish() and removed by
+  // unshare() or when the drawing is destroyed.
+  void share(const std::string& name){
+    _shared.reset(new SharedDrawing{name, std::max<std::size_t>(1024, _drawing_u_ptrs.size())});
+    _shared_stale = true;
+    publish();
+  }
+
+  void unshare(){
+    _shared.reset();
+  }
+
+  // Bring the segment up to date, e.g. once per frame. Only elements
+  // changed since the last publish() are written, unless handles
+  // changed, in which case all of them are. Holes left by remove()
+  // are published as removed_element records.
+  void publish(){
+    TRACE_SCOPE("Drawing::publish");
+    if(!_shared){
+      return;
+    }
+    std::size_t n = _drawing_u_ptrs.size();
+    _shared->begin_update();
+    _shared->reserve(n);
+    ElementRecord* records = _shared->records();
+    if(_shared_stale){
+      parallel_for(n, [&](std::size_t, std::size_t begin, std::size_t end){
+        for(std::size_t i = begin; i < end; ++i){
+          records[i] = record_at(i);
+        }
+      });
+    } else{
+      _shared_dirty.for_each([&](std::size_t i){
+        if(i < n){
+          records[i] = record_at(i);
+        }
+      });
+    }
+    _shared->set_count(n);
+    _shared->end_update();
+    _shared_dirty.resize(0);
+    _shared_stale = false;
+  }
+
+  // Write-ahead log ------------------------------
+
+  // Log every further mutation to `path`
+  void enable_log(const std::string& path, LogOptions options = {}){
+    _log.reset(new DrawingLog{path, options});
+  }
+
+  // Stop logging; entries already appended are synced first
+  void disable_log(){
+    _log.reset();
+  }
+
+  DrawingLog* log(){
+    return _log.get();
+  }
+
+  // Write the current state to `checkpoint_path`; the log can
+  // then be emptied, since replay starts from the checkpoint. Both
+  // start with the same generation, so if we stop between the two
+  // the old log is skipped on recovery instead of replayed twice.
+  void checkpoint(const std::string& checkpoint_path){
+    TRACE_SCOPE("Drawing::checkpoint");
+    std::uint32_t generation = 0;
+    if(_log){
+      generation = _log->generation() + 1;
+      _log->begin_generation(generation);
+    }
+    std::vector<DrawingLog::Entry> entries;
+    entries.push_back(DrawingLog::make_entry(DrawingLog::Op::Generation, {}, generation));
+    for(auto ptr: _drawing_ptrs){
+      if(ptr != nullptr){
+        entries.push_back(DrawingLog::make_entry(DrawingLog::Op::AddPtr, ptr->record()));
+      }
+    }
+    // Holes are kept, as a placeholder removed again, so that the
+    // handles in later log entries still match
+    const ElementRecord placeholder{ElementType::Point, 0, {0, 0, 0, 0}};
+    for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+      if(_drawing_u_ptrs[i]){
+        entries.push_back(DrawingLog::make_entry(DrawingLog::Op::AddUPtr, _drawing_u_ptrs[i]->record()));
+      } else{
+        entries.push_back(DrawingLog::make_entry(DrawingLog::Op::AddUPtr, placeholder));
+        entries.push_back(DrawingLog::make_entry(DrawingLog::Op::Remove, placeholder, i));
+      }
+    }
+    DrawingLog::write_file(checkpoint_path, entries);
+    if(_log){
+      _log->truncate();
+    }
+  }
+
+  // Rebuild the drawing after a crash: load the last checkpoint,
+  // then replay the log on top of it, skipping log entries older
+  // than the checkpoint. Elements recovered into the pointer
+  // collection are owned by the drawing from then on.
+  std::size_t recover(const std::string& checkpoint_path, const std::string& log_path){
+    TRACE_SCOPE("Drawing::recover");
+    ArenaScope scope{_arena.get()};
+    std::unique_ptr<DrawingLog> log = std::move(_log);
+    clear_drawing_ptrs();
+    _drawing_u_ptrs.clear();
+
+    auto apply = [this](const DrawingLog::Entry& entry){
+      ElementRecord record{entry.type, entry.layer, {entry.v[0], entry.v[1], entry.v[2], entry.v[3]}};
+      switch(entry.op){
+      case DrawingLog::Op::AddPtr:     _drawing_ptrs.push_back(make_element(record).release()); break;
+      case DrawingLog::Op::AddUPtr:    _drawing_u_ptrs.emplace_back(make_element(record)); break;
+      case DrawingLog::Op::ClearPtrs:  clear_drawing_ptrs(); break;
+      case DrawingLog::Op::ClearUPtrs: _drawing_u_ptrs.clear(); break;
+      case DrawingLog::Op::SortByLayer: sort_by_layer(); break;
+      case DrawingLog::Op::Update:
+        if(entry.handle < _drawing_u_ptrs.size()){
+          _drawing_u_ptrs[entry.handle] = make_element(record);
+        }
+        break;
+      case DrawingLog::Op::Translate: translate(record.v[0], record.v[1]); break;
+      case DrawingLog::Op::Remove:
+        if(entry.handle < _drawing_u_ptrs.size()){
+          _drawing_u_ptrs[entry.handle].reset();
+        }
+        break;
+      case DrawingLog::Op::Compact: compact(); break;
+      case DrawingLog::Op::Generation: break;
+      }
+    };
+    std::uint32_t checkpoint_generation = 0;
+    std::uint32_t log_generation = 0;
+    std::size_t replayed = 0;
+    DrawingLog::replay(checkpoint_path, [&](const DrawingLog::Entry& entry){
+      if(entry.op == DrawingLog::Op::Generation){
+        checkpoint_generation = entry.handle;
+        return;
+      }
+      apply(entry);
+      ++replayed;
+    });
+    DrawingLog::replay(log_path, [&](const DrawingLog::Entry& entry){
+      if(entry.op == DrawingLog::Op::Generation){
+        log_generation = entry.handle;
+      } else if(log_generation >= checkpoint_generation){
+        apply(entry);
+        ++replayed;
+      }
+    });
+    if(log_generation < checkpoint_generation){
+      // The log predates the checkpoint; restart it, or entries
+      // appended from here on would be skipped next time too
+      if(log){
+        log->begin_generation(checkpoint_generation);
+        log->truncate();
+      } else{
+        DrawingLog::write_file(log_path, {DrawingLog::make_entry(DrawingLog::Op::Generation, {}, checkpoint_generation)});
+      }
+    }
+    _log = std::move(log);
+    _columns_stale = true;
+    _structure_changed = true;
+    _dirty.resize(_drawing_u_ptrs.size());
+    _shared_stale = true;
+    _holes = std::size_t(std::count(_drawing_u_ptrs.begin(), _drawing_u_ptrs.end(), nullptr));
+    _attributes.clear(); // Not logged
+    if(numa_enabled()){
+      repartition();
+    }
+    queue_change(ChangeRecord::Kind::Reset);
+    return replayed;
+  }
+
+private:
+
+  // Plain-data copy of element `i`, or a removed_element record for a hole
+  ElementRecord record_at(std::size_t i) const{
+    if(!_drawing_u_ptrs[i]){
+      return ElementRecord{removed_element, 0, {0, 0, 0, 0}};
+    }
+    return record_of(*_drawing_u_ptrs[i]);
+  }
+
+  // Plain-data copies of the unique pointer collection
+  std::vector<ElementRecord> records() const{
+    std::vector<ElementRecord> records(_drawing_u_ptrs.size());
+    parallel_for(records.size(), [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t i = begin; i < end; ++i){
+        records[i] = record_at(i);
+      }
+    });
+    return records;
+  }
+
+  // Element `handle`, which must not have been removed
+  // Scratch for clip_lines(), kept for its capacity. One per thread,
+  // so that threads rendering the same const Drawing don't share it.
+  static ClippedLines& clip_scratch(){
+    thread_local ClippedLines lines;
+    return lines;
+  }
+
+  std::unique_ptr<DrawingElement>& element_at(ElementHandle handle){
+    std::unique_ptr<DrawingElement>& slot = _drawing_u_ptrs.at(handle);
+    if(!slot){
+      throw std::out_of_range{"Element has been removed"};
+    }
+    return slot;
+  }
+
+  std::vector<Overlap> find_overlaps(std::size_t workers) const{
+    TRACE_SCOPE("Drawing::find_overlaps");
+    std::vector<ElementRecord> elements = records();
+    std::size_t n = elements.size();
+
+    struct Candidate{
+      Bounds box;
+      std::size_t index;
+    };
+    std::vector<Candidate> sweep;
+    sweep.reserve(n);
+    for(std::size_t i = 0; i < n; ++i){
+      if(elements[i].type != removed_element){
+        sweep.push_back({bounds(elements[i]), i});
+      }
+    }
+    n = sweep.size();
+    std::sort(sweep.begin(), sweep.end(), [](const Candidate& a, const Candidate& b){
+      return a.box.min_x < b.box.min_x || (a.box.min_x == b.box.min_x && a.index < b.index);
+    });
+
+    // Each worker sweeps a contiguous range of starting boxes
+    std::vector<std::vector<Overlap>> found(workers);
+    auto sweep_range = [&](std::size_t w, std::size_t begin, std::size_t end){
+      TRACE_SCOPE("find_overlaps worker");
+      for(std::size_t i = begin; i < end; ++i){
+        const Candidate& a = sweep[i];
+        for(std::size_t j = i + 1; j < n && sweep[j].box.min_x <= a.box.max_x; ++j){
+          const Candidate& b = sweep[j];
+          if(b.box.min_y <= a.box.max_y && a.box.min_y <= b.box.max_y
+             && elements_overlap(elements[a.index], elements[b.index])){
+            found[w].push_back({std::min(a.index, b.index), std::max(a.index, b.index)});
+          }
+        }
+      }
+    };
+    if(workers == 1){
+      sweep_range(0, 0, n);
+    } else{
+      std::vector<std::thread> threads;
+      for(std::size_t w = 0; w < workers; ++w){
+        threads.emplace_back(sweep_range, w, n * w / workers, n * (w + 1) / workers);
+      }
+      for(auto& thread: threads){
+        thread.join();
+      }
+    }
+
+    std::vector<Overlap> overlaps;
+    for(auto& part: found){
+      overlaps.insert(overlaps.end(), part.begin(), part.end());
+    }
+    return overlaps;
+  }
+
+  // Packed key: | unused | layer (biased, 16) | type (8) | index (32) |.
+  // Only the layer and type bytes are radix-sorted; the index rides
+  // along and tells where each element goes (and, if asked, fills
+  // `new_handle[old index]`).
+  template<typename Pointer>
+  static void sort_by_layer(std::vector<Pointer>& elements, std::vector<ElementHandle>* new_handle = nullptr){
+    std::size_t n = elements.size();
+    std::vector<std::uint64_t> keys(n);
+    parallel_for(n, [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t i = begin; i < end; ++i){
+        std::uint64_t layer = 0xFFFF, type = 0xFF;
+        if(elements[i] != nullptr){
+          layer = std::uint16_t(elements[i]->layer() + 32768);
+          type  = elements[i]->tag();
+        }
+        keys[i] = (layer << 40) | (type << 32) | i;
+      }
+    });
+
+    parallel_radix_sort(keys, 4, 6);
+
+    std::vector<Pointer> sorted(n);
+    if(new_handle != nullptr){
+      new_handle->resize(n);
+    }
+    parallel_for(n, [&](std::size_t, std::size_t begin, std::size_t end){
+      for(std::size_t i = begin; i < end; ++i){
+        std::size_t from = keys[i] & 0xFFFFFFFF;
+        sorted[i] = std::move(elements[from]);
+        if(new_handle != nullptr){
+          (*new_handle)[from] = i;
+        }
+      }
+    });
+    elements.swap(sorted);
+  }
+
+  template<typename Element>
+  static void check_type(const DrawingElement& element){
+    if constexpr(!std::is_same<Element, DrawingElement>::value){
+      if(element.tag() != static_cast<unsigned char>(Element::element_type)){
+        throw std::invalid_argument{"Element is not of the requested type"};
+      }
+    }
+  }
+
+  // After an update: log and mark it, and patch the columns in place
+  void changed(ElementHandle handle, const DrawingElement& element){
+    record_mutation(DrawingLog::Op::Update, &element, handle);
+    if(!_columns_stale){
+      _columns.assign(_column_slots[handle], record_of(element));
+    }
+  }
+
+  // Each distance runs `rounds` times, each time on a fresh window,
+  // and counts its best time. Windows shrink to fit every run into
+  // the collection once. Timings are noisy, so the shortest
+  // distance within 2% of the fastest wins.
+  template<typename Pointer>
+  void calibrate_prefetch(const std::vector<Pointer>& elements){
+    static constexpr std::size_t distances[] = {0, 1, 2, 4, 8, 16, 32};
+    static constexpr std::size_t candidates = sizeof(distances) / sizeof(distances[0]);
+    static constexpr std::size_t max_window = 4096;
+    static constexpr std::size_t rounds = 3;
+    static constexpr std::size_t runs = rounds * candidates;
+    std::size_t n = elements.size();
+    std::size_t window = std::max<std::size_t>(1, std::min(max_window, n / runs));
+
+    std::vector<double> times(candidates, std::numeric_limits<double>::max());
+    long long sum = 0;
+    for(std::size_t run = 0; run < runs; ++run){
+      std::size_t k = run % candidates;
+      std::size_t begin = n > 0 ? run * window % n : 0;
+      std::size_t end   = std::min(n, begin + window);
+      auto start = std::chrono::steady_clock::now();
+      for(std::size_t i = begin; i < end; ++i){
+        prefetch_ahead(elements, i, distances[k]);
+        if(const DrawingElement* element = element_address(elements[i])){
+          const ElementRecord record = record_of(*element);
+          sum += record.v[0];
+        }
+      }
+      times[k] = std::min(times[k], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    _calibration_sink = sum; // Keeps the reads
+
+    double fastest = *std::min_element(times.begin(), times.end());
+    std::size_t k = 0;
+    while(times[k] > fastest * 1.02){
+      ++k;
+    }
+    _prefetch_distance = distances[k];
+  }
+
+  // Recreate each NUMA range's elements in its node's arena, by
+  // threads on that node, `min_chunk` or more elements per thread
+  void relocate_partitions(std::size_t min_chunk){
+    numa_parallel_for(partitions(), [&](std::size_t node, std::size_t begin, std::size_t end){
+      ArenaScope scope{_node_arenas[node].get()};
+      for(std::size_t i = begin; i < end; ++i){
+        if(_drawing_u_ptrs[i] && _drawing_u_ptrs[i]->tag() != DrawingElement::extension_tag){
+          _drawing_u_ptrs[i] = make_element(record_of(*_drawing_u_ptrs[i]));
+        }
+      }
+    }, min_chunk);
+  }
+
+  // Done with `arena`: it goes back to its pool unless elements
+  // that couldn't be moved (other classes, the pointer collection,
+  // or ones made but not added) still live in it
+  void retire(std::unique_ptr<ElementArena> arena){
+    _retired_arenas.erase(std::remove_if(_retired_arenas.begin(), _retired_arenas.end(),
+                                         [](const std::unique_ptr<ElementArena>& retired){
+                                           return retired->stats().live_elements == 0;
+                                         }),
+                          _retired_arenas.end());
+    if(arena && arena->stats().live_elements > 0){
+      _retired_arenas.push_back(std::move(arena));
+    }
+  }
+
+  // Traverse the unique pointer collection as render does, counting
+  // cache misses if the hardware counters are available, and how
+  // often the next element isn't on the same or the next cache line
+  void measure_traversal(double& misses, double& scattered) const{
+    PerfCounters counters;
+    std::uint64_t sum = 0;
+    counters.start();
+    for(auto& elementPtr: _drawing_u_ptrs){
+      if(elementPtr){
+        sum += std::uint64_t(record_of(*elementPtr).v[0]);
+      }
+    }
+    counters.stop();
+    volatile std::uint64_t sink = sum; // Keep the loop
+    (void)sink;
+
+    std::size_t live = 0, jumps = 0;
+    std::uintptr_t previous = 0;
+    for(auto& elementPtr: _drawing_u_ptrs){
+      if(elementPtr){
+        std::uintptr_t line = reinterpret_cast<std::uintptr_t>(elementPtr.get()) / 64;
+        jumps += live > 0 && line != previous && line != previous + 1;
+        previous = line;
+        ++live;
+      }
+    }
+    double per = 1.0 / double(std::max<std::size_t>(1, live));
+    double count = counters.count("LLC misses");
+    misses    = count < 0 ? -1 : count * per;
+    scattered = double(jumps) * per;
+  }
+
+  // Handle ranges per node for numa_parallel_for(): the ranges set
+  // by repartition(), with any elements added since on the last node
+  std::vector<std::size_t> partitions() const{
+    std::size_t n = _drawing_u_ptrs.size();
+    if(_partition_begin.empty()){
+      return {0, n};
+    }
+    std::vector<std::size_t> ranges = _partition_begin;
+    for(std::size_t& begin: ranges){
+      begin = std::min(begin, n);
+    }
+    ranges.back() = n;
+    return ranges;
+  }
+
+  // Called on every mutation: logs it, invalidates derived data and
+  // tracks which elements of the unique pointer collection changed
+  void record_mutation(DrawingLog::Op op, const DrawingElement* element = nullptr, ElementHandle handle = 0){
+    track_mutation(op, handle);
+    if(_log){
+      _log->append(op, element != nullptr ? record_of(*element) : ElementRecord{}, handle);
+    }
+  }
+
+  void track_mutation(DrawingLog::Op op, ElementHandle handle = 0){
+    if(_shared){
+      if(op == DrawingLog::Op::AddUPtr || op == DrawingLog::Op::Update || op == DrawingLog::Op::Remove){
+        _shared_dirty.set(handle);
+      } else if(op != DrawingLog::Op::AddPtr && op != DrawingLog::Op::ClearPtrs){
+        _shared_stale = true;
+      }
+    }
+    switch(op){
+    case DrawingLog::Op::AddUPtr:
+      _columns_stale = true;
+      _dirty.set(handle);
+      queue_change(ChangeRecord::Kind::Added, handle);
+      break;
+    case DrawingLog::Op::Update:
+      _dirty.set(handle);
+      queue_change(ChangeRecord::Kind::Updated, handle);
+      break;
+    case DrawingLog::Op::Remove:
+      ++_holes;
+      _columns_stale = true;
+      _dirty.set(handle);
+      queue_change(ChangeRecord::Kind::Removed, handle);
+      break;
+    case DrawingLog::Op::ClearUPtrs:
+    case DrawingLog::Op::SortByLayer:
+    case DrawingLog::Op::Compact:
+      if(op == DrawingLog::Op::ClearUPtrs){
+        _attributes.clear();
+        // New elements go on the last node, as after repartition()
+        std::fill(_partition_begin.begin(), _partition_begin.end(), 0);
+      }
+      if(op != DrawingLog::Op::SortByLayer){
+        _holes = 0;
+      }
+      _columns_stale = true;
+      _structure_changed = true;
+      _dirty.resize(0);
+      queue_change(op == DrawingLog::Op::ClearUPtrs ? ChangeRecord::Kind::Cleared
+                   : op == DrawingLog::Op::Compact  ? ChangeRecord::Kind::Compacted
+                   :                                  ChangeRecord::Kind::Reordered);
+      break;
+    case DrawingLog::Op::Translate:
+      // translate() moves the columns along with the elements
+      _dirty.resize(_drawing_u_ptrs.size());
+      _dirty.set_all();
+      queue_change(ChangeRecord::Kind::Moved);
+      break;
+    default:
+      break; // The pointer collection isn't tracked
+    }
+  }
+
+  void queue_change(ChangeRecord::Kind kind, ElementHandle handle = 0){
+    if(_observers.empty()){
+      return;
+    }
+    bool per_element = kind == ChangeRecord::Kind::Added || kind == ChangeRecord::Kind::Updated;
+    if(kind == ChangeRecord::Kind::Removed){
+      _queued_handles.set(handle); // Never folded: earlier records must not hide it
+    } else if(per_element){
+      if(_queued_handles.test(handle)){
+        return; // Already queued in this batch
+      }
+      _queued_handles.set(handle);
+    } else{
+      _queued_handles.resize(0); // Handles before this no longer match
+    }
+    _queued_changes.push_back({kind, handle});
+  }
+
+  // Column copy of the unique pointer collection, rebuilt on demand
+  const GeometryColumns& columns() const{
+    if(_columns_stale){
+      _columns.clear();
+      _column_slots.resize(_drawing_u_ptrs.size());
+      for(std::size_t i = 0; i < _drawing_u_ptrs.size(); ++i){
+        if(!_drawing_u_ptrs[i]){
+          continue;
+        }
+        ElementRecord record = record_of(*_drawing_u_ptrs[i]);
+        _column_slots[i] = _columns.next_slot(record.type);
+        _columns.append(record, i);
+      }
+      _columns_stale = false;
+    }
+    return _columns;
+  }
+
+  // Arena for this drawing's elements, if it uses a pool. Declared
+  // first, so it outlives the collections.
+  std::unique_ptr<ElementArena> _arena;
+
+  // Arenas replaced by defragment() that still hold elements
+  std::vector<std::unique_ptr<ElementArena>> _retired_arenas;
+
+  // Per-node arenas and the first handle of each node's range, once
+  // enable_numa() is called
+  std::vector<std::unique_ptr<ElementArena>> _node_arenas;
+  std::vector<std::size_t> _partition_begin;
+
+  // Collection of drawing elements
+  std::vector<DrawingElement> _drawing;
+
+  // Collection of pointers to drawing elements
+  std::vector<DrawingElement*> _drawing_ptrs;
+
+  // Collection of unique pointers to drawing elements
+  std::vector<std::unique_ptr<DrawingElement>> _drawing_u_ptrs;
+
+  // Write-ahead log, if enabled
+  std::unique_ptr<DrawingLog> _log;
+
+  // Cold attributes, by handle
+  AttributeTable _attributes;
+
+  // Prefetch distance for the render loops; what calibration read
+  std::size_t _prefetch_distance{0};
+  long long _calibration_sink{0};
+
+  // Holes left by remove() in the unique pointer collection, when
+  // to squeeze them out, and where the last compaction moved handles
+  std::size_t _holes{0};
+  CompactionOptions _compaction;
+  std::vector<ElementHandle> _compaction_map;
+
+  // Shared-memory copy, if shared, and what it's missing since the
+  // last publish()
+  std::unique_ptr<SharedDrawing> _shared;
+  DirtySet _shared_dirty;
+  bool _shared_stale{false};
+
+  // Geometry of `_drawing_u_ptrs` by column, for scans
+  mutable GeometryColumns _columns;
+  mutable std::vector<std::size_t> _column_slots; // Handle -> position in its type's columns
+  mutable bool _columns_stale{true};
+
+  // Elements changed since the last clear_changes()
+  DirtySet _dirty;
+  bool _structure_changed{false};
+
+  // Observers, and the changes waiting for the next flush
+  std::vector<DrawingObserver*> _observers;
+  std::vector<ChangeRecord> _queued_changes;
+  DirtySet _queued_handles;
+  int _batch_depth{0};
+
+};
+
+// --------------------------------------------------
+// Paged storage
+//
+// For drawings larger than memory. A PagedDrawing keeps its
+// elements as ElementRecords in a file, in fixed-size chunks, and
+// only the chunks in its page cache are in memory: the least
+// recently used one is written back (if changed) and dropped when
+// the cache is over its budget. Scans go chunk by chunk, asking
+// the kernel to read the next few chunks ahead meanwhile.
+//
+// The file is scratch space, truncated when the drawing is created
+// and removed when it is destroyed.
+// --------------------------------------------------
+
+struct PageCacheOptions{
+  std::size_t budget_bytes{64 << 20}; // At least one chunk is always cached
+  std::size_t prefetch_chunks{4};     // Read ahead this many chunks during scans
+};
+
+class PageCache{
+public:
+  static constexpr std::size_t chunk_records = 4096;
+  static constexpr std::size_t chunk_bytes   = chunk_records * sizeof(ElementRecord);
+
+  struct Stats{
+    std::uint64_t hits{0};
+    std::uint64_t misses{0};
+    std::uint64_t write_backs{0};
+  };
+
+  PageCache(const std::string& path, PageCacheOptions options):
+    _path(path), _options(options),
+    _max_pages(std::max<std::size_t>(1, options.budget_bytes / chunk_bytes)){
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(_fd < 0){
+      throw std::runtime_error{"Cannot open page file " + path};
+    }
+  }
+
+  ~PageCache(){
+    ::close(_fd);
+    ::unlink(_path.c_str());
+  }
+
+  PageCache(const PageCache&) = delete;
+  PageCache& operator=(const PageCache&) = delete;
+
+  // Records of chunk `index`, read in if needed. Valid until the
+  // next call; pass `write` to have them written back on eviction.
+  ElementRecord* chunk(std::size_t index, bool write = false){
+    if(index >= _resident.size()){
+      _resident.resize(index + 1, _pages.end());
+    }
+    auto page = _resident[index];
+    if(page != _pages.end()){
+      ++_stats.hits;
+      _pages.splice(_pages.begin(), _pages, page); // Now the most recent
+    } else{
+      ++_stats.misses;
+      std::vector<ElementRecord> records;
+      if(_pages.size() >= _max_pages){
+        records = evict();
+      }
+      records.resize(chunk_records);
+      read_chunk(index, records.data());
+      _pages.push_front(Page{index, false, std::move(records)});
+      _resident[index] = _pages.begin();
+    }
+    _pages.front().dirty |= write;
+    return _pages.front().records.data();
+  }
+
+  // Hint that chunks [first, first + count) will be needed soon
+  void prefetch(std::size_t first, std::size_t count){
+#ifdef __linux__
+    ::posix_fadvise(_fd, off_t(first * chunk_bytes), off_t(count * chunk_bytes), POSIX_FADV_WILLNEED);
+#else
+    (void)first;
+    (void)count;
+#endif
+  }
+
+  std::size_t prefetch_chunks() const{
+    return _options.prefetch_chunks;
+  }
+
+  // Write every changed chunk back to the file
+  void flush(){
+    for(Page& page: _pages){
+      if(page.dirty){
+        write_chunk(page);
+      }
+    }
+  }
+
+  std::size_t resident_bytes() const{
+    return _pages.size() * chunk_bytes;
+  }
+
+  const Stats& stats() const{
+    return _stats;
+  }
+
+private:
+  struct Page{
+    std::size_t index;
+    bool dirty;
+    std::vector<ElementRecord> records;
+  };
+
+  // Drop the least recently used page, handing back its buffer
+  std::vector<ElementRecord> evict(){
+    Page& page = _pages.back();
+    if(page.dirty){
+      write_chunk(page);
+    }
+    std::vector<ElementRecord> records = std::move(page.records);
+    _resident[page.index] = _pages.end();
+    _pages.pop_back();
+    return records;
+  }
+
+  // Chunks past the end of the file read as zeros
+  void read_chunk(std::size_t index, ElementRecord* records){
+    char* bytes = reinterpret_cast<char*>(records);
+    std::size_t done = 0;
+    while(done < chunk_bytes){
+      ssize_t got = ::pread(_fd, bytes + done, chunk_bytes - done, off_t(index * chunk_bytes + done));
+      if(got < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        throw std::runtime_error{"Cannot read page file " + _path};
+      }
+      if(got == 0){
+        std::memset(bytes + done, 0, chunk_bytes - done);
+        break;
+      }
+      done += got;
+    }
+  }
+
+  void write_chunk(Page& page){
+    const char* bytes = reinterpret_cast<const char*>(page.records.data());
+    std::size_t done = 0;
+    while(done < chunk_bytes){
+      ssize_t put = ::pwrite(_fd, bytes + done, chunk_bytes - done, off_t(page.index * chunk_bytes + done));
+      if(put < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        throw std::runtime_error{"Cannot write page file " + _path};
+      }
+      done += put;
+    }
+    page.dirty = false;
+    ++_stats.write_backs;
+  }
+
+  std::string _path;
+  PageCacheOptions _options;
+  std::size_t _max_pages;
+  int _fd;
+
+  std::list<Page> _pages; // Most recently used first
+  std::vector<std::list<Page>::iterator> _resident; // Chunk -> its page, or _pages.end()
+  Stats _stats;
+};
+
+// Drawing's unique pointer API for elements that don't all fit in
+// memory, less what needs them as objects: observers, attributes,
+// the log, NUMA placement and rasterization. Elements go in and come
+// out by value: update() hands `mutate` a temporary element and
+// stores it back. There's one collection, so the raw pointer calls
+// work on it too.
+class PagedDrawing{
+public:
+  explicit PagedDrawing(const std::string& path, PageCacheOptions options = {}):
+    _path(path), _options(options), _cache(path, options){}
+
+  std::size_t size() const{
+    return _size;
+  }
+
+  // Add a built-in element; other classes can't be stored
+  ElementHandle add_element_u_ptr(std::unique_ptr<DrawingElement> element_u_ptr){
+    TRACE_SCOPE("PagedDrawing::add_element_u_ptr");
+    if(element_u_ptr->tag() == DrawingElement::extension_tag){
+      throw std::invalid_argument{"Only built-in elements can be paged"};
+    }
+    ElementHandle handle = _size++;
+    record(handle, true) = record_of(*element_u_ptr);
+    return handle;
+  }
+
+  void add_elements(const std::vector<ElementRecord>& records){
+    TRACE_SCOPE("PagedDrawing::add_elements");
+    store(_size, records.data(), records.size());
+    _size += records.size();
+  }
+
+  // Holes left by remove() render as nothing
+  void render_u_ptrs(){
+    TRACE_SCOPE("PagedDrawing::render_u_ptrs");
+    std::cout << std::endl;
+    std::cout << "Rendering " << _size - _holes << " elements from paged storage" << std::endl;
+    scan([](const ElementRecord* records, std::size_t n, ElementHandle){
+      for(std::size_t i = 0; i < n; ++i){
+        render_record(records[i]);
+      }
+    });
+  }
+
+  void render_ptrs(){
+    render_u_ptrs();
+  }
+
+  // Records already carry their type, so this is render_u_ptrs()
+  void render_tagged(){
+    render_u_ptrs();
+  }
+
+  // Reorder by (layer, type), keeping insertion order within each,
+  // as Drawing::sort_by_layer(); holes go to the end. One pass counts
+  // the elements of each key, a second deals them out to a scratch
+  // page file, the third copies them back. The scratch file has a
+  // cache of its own, so this can hold twice the budget in memory.
+  void sort_by_layer(){
+    TRACE_SCOPE("PagedDrawing::sort_by_layer");
+    auto key = [](const ElementRecord& record){
+      if(record.type == removed_element){
+        return std::uint32_t{0xFFFFFF};
+      }
+      return std::uint32_t(std::uint16_t(record.layer + 32768)) << 8 | static_cast<unsigned char>(record.type);
+    };
+    std::map<std::uint32_t, std::size_t> next; // Key -> its count, then the handle its next element goes to
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle){
+      for(std::size_t i = 0; i < n; ++i){
+        ++next[key(records[i])];
+      }
+    });
+    std::size_t position = 0;
+    for(auto& entry: next){
+      std::size_t count = entry.second;
+      entry.second = position;
+      position += count;
+    }
+
+    PageCache sorted{_path + ".sort", _options};
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle){
+      for(std::size_t i = 0; i < n; ++i){
+        std::size_t to = next[key(records[i])]++;
+        sorted.chunk(to / PageCache::chunk_records, true)[to % PageCache::chunk_records] = records[i];
+      }
+    });
+    scan([&](ElementRecord* records, std::size_t n, ElementHandle first){
+      const ElementRecord* from = sorted.chunk(first / PageCache::chunk_records);
+      std::copy(from, from + n, records);
+    }, true);
+  }
+
+  // Change element `handle` in place, as Drawing::update()
+  template<typename Element = DrawingElement, typename Mutate>
+  void update(ElementHandle handle, Mutate&& mutate){
+    TRACE_SCOPE("PagedDrawing::update");
+    ElementRecord& slot = live_record(handle);
+    std::unique_ptr<DrawingElement> element = make_element(slot);
+    if constexpr(!std::is_same<Element, DrawingElement>::value){
+      if(element->tag() != static_cast<unsigned char>(Element::element_type)){
+        throw std::invalid_argument{"Element is not of the requested type"};
+      }
+    }
+    mutate(*static_cast<Element*>(element.get()));
+    slot = record_of(*element);
+  }
+
+  void replace(ElementHandle handle, const ElementRecord& record){
+    TRACE_SCOPE("PagedDrawing::replace");
+    live_record(handle) = record;
+  }
+
+  // Mark element `handle` removed, leaving a hole so that the other
+  // handles stay valid, as Drawing::remove(). Holes are skipped by
+  // every scan and squeezed out by compact(), which runs by itself
+  // once they pass the ratio set by set_compaction().
+  void remove(ElementHandle handle){
+    TRACE_SCOPE("PagedDrawing::remove");
+    live_record(handle).type = removed_element;
+    ++_holes;
+    if(_holes >= _compaction.min_holes
+       && double(_holes) > _compaction.max_hole_ratio * double(_size)){
+      compact();
+    }
+  }
+
+  void set_compaction(Drawing::CompactionOptions options){
+    _compaction = options;
+  }
+
+  std::size_t holes() const{
+    return _holes;
+  }
+
+  // Squeeze the holes out in one pass, keeping the order of the
+  // remaining elements. Elements only move down, so each chunk is
+  // copied out before they're written back. Handles change: each
+  // element's goes down by the number of holes before it.
+  void compact(){
+    TRACE_SCOPE("PagedDrawing::compact");
+    std::vector<ElementRecord> live;
+    live.reserve(PageCache::chunk_records);
+    std::size_t size = 0;
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle){
+      live.clear();
+      for(std::size_t i = 0; i < n; ++i){
+        if(records[i].type != removed_element){
+          live.push_back(records[i]);
+        }
+      }
+      store(size, live.data(), live.size());
+      size += live.size();
+    });
+    _size = size;
+    _holes = 0;
+  }
+
+  void translate(int dx, int dy){
+    TRACE_SCOPE("PagedDrawing::translate");
+    scan([&](ElementRecord* records, std::size_t n, ElementHandle){
+      for(std::size_t i = 0; i < n; ++i){
+        records[i].v[0] += dx;
+        records[i].v[1] += dy;
+        if(records[i].type == ElementType::Line){
+          records[i].v[2] += dx;
+          records[i].v[3] += dy;
+        }
+      }
+    }, true);
+  }
+
+  // Same figures as Drawing::stats(), one chunk's columns at a time
+  DrawingStats stats() const{
+    TRACE_SCOPE("PagedDrawing::stats");
+    DrawingStats total;
+    std::size_t total_vertices = 0;
+    GeometryColumns columns;
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle){
+      columns.clear();
+      for(std::size_t i = 0; i < n; ++i){
+        columns.append(records[i]);
+      }
+      DrawingStats chunk = compute_stats(columns);
+      // Points count once, lines and rectangles twice, as in compute_stats()
+      std::size_t vertices = chunk.points + 2 * (chunk.lines + chunk.rectangles);
+      if(vertices == 0){
+        return;
+      }
+      if(total_vertices == 0){
+        total.min_x = chunk.min_x; total.max_x = chunk.max_x;
+        total.min_y = chunk.min_y; total.max_y = chunk.max_y;
+      }
+      total.min_x = std::min(total.min_x, chunk.min_x);
+      total.min_y = std::min(total.min_y, chunk.min_y);
+      total.max_x = std::max(total.max_x, chunk.max_x);
+      total.max_y = std::max(total.max_y, chunk.max_y);
+      double weight = double(vertices) / double(total_vertices + vertices);
+      total.centroid_x += (chunk.centroid_x - total.centroid_x) * weight;
+      total.centroid_y += (chunk.centroid_y - total.centroid_y) * weight;
+      total_vertices += vertices;
+
+      total.points         += chunk.points;
+      total.lines          += chunk.lines;
+      total.rectangles     += chunk.rectangles;
+      total.rectangle_area += chunk.rectangle_area;
+      total.line_length    += chunk.line_length;
+    });
+    return total;
+  }
+
+  // Handles of the elements whose bounding box meets `viewport`, in
+  // increasing order, as Drawing::cull()
+  std::vector<ElementHandle> cull(const Bounds& viewport) const{
+    TRACE_SCOPE("PagedDrawing::cull");
+    std::vector<ElementHandle> handles;
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle first){
+      for(std::size_t i = 0; i < n; ++i){
+        if(records[i].type != removed_element && boxes_overlap(bounds(records[i]), viewport)){
+          handles.push_back(first + i);
+        }
+      }
+    });
+    return handles;
+  }
+
+  // All pairs of overlapping elements, as Drawing::find_overlaps().
+  // The sweep needs its candidates in memory, so the drawing is cut
+  // into vertical strips of about a cache budget's worth each and
+  // swept a strip at a time. An element goes into every strip it
+  // meets; a pair is kept only in the strip where the later of the
+  // two starts, so it comes out once. Strips are even in x: a clustered drawing can
+  // put more than the budget in one.
+  std::vector<Drawing::Overlap> find_overlaps() const{
+    TRACE_SCOPE("PagedDrawing::find_overlaps");
+    struct Candidate{
+      Bounds box;
+      ElementRecord record;
+      ElementHandle handle;
+    };
+    std::vector<Drawing::Overlap> overlaps;
+    long long min_x = std::numeric_limits<long long>::max(), max_x = std::numeric_limits<long long>::min();
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle){
+      for(std::size_t i = 0; i < n; ++i){
+        if(records[i].type != removed_element){
+          Bounds box = bounds(records[i]);
+          min_x = std::min(min_x, box.min_x);
+          max_x = std::max(max_x, box.max_x);
+        }
+      }
+    });
+    if(min_x > max_x){
+      return overlaps;
+    }
+    std::size_t strips = std::max<std::size_t>(1, (_size - _holes) * sizeof(Candidate) / std::max<std::size_t>(1, _options.budget_bytes));
+    long long width = (max_x - min_x) / (long long)strips + 1;
+    auto strip_of = [&](long long x){
+      return std::size_t((x - min_x) / width);
+    };
+
+    std::vector<Candidate> sweep;
+    for(std::size_t s = 0; s < strips; ++s){
+      long long left = min_x + (long long)s * width, right = left + width - 1;
+      sweep.clear();
+      scan([&](const ElementRecord* records, std::size_t n, ElementHandle first){
+        for(std::size_t i = 0; i < n; ++i){
+          if(records[i].type == removed_element){
+            continue;
+          }
+          Bounds box = bounds(records[i]);
+          if(box.min_x <= right && box.max_x >= left){
+            sweep.push_back({box, records[i], first + i});
+          }
+        }
+      });
+      std::sort(sweep.begin(), sweep.end(), [](const Candidate& a, const Candidate& b){
+        return a.box.min_x < b.box.min_x || (a.box.min_x == b.box.min_x && a.handle < b.handle);
+      });
+      for(std::size_t i = 0; i < sweep.size(); ++i){
+        const Candidate& a = sweep[i];
+        for(std::size_t j = i + 1; j < sweep.size() && sweep[j].box.min_x <= a.box.max_x; ++j){
+          const Candidate& b = sweep[j];
+          // b starts no earlier than a
+          if(b.box.min_y <= a.box.max_y && a.box.min_y <= b.box.max_y
+             && strip_of(b.box.min_x) == s
+             && elements_overlap(a.record, b.record)){
+            overlaps.push_back({std::min(a.handle, b.handle), std::max(a.handle, b.handle)});
+          }
+        }
+      }
+    }
+    return overlaps;
+  }
+
+  // Call visit(const ElementRecord*, count, first handle) on each chunk in order
+  template<typename Visit>
+  void visit_chunks(Visit&& visit) const{
+    scan([&](const ElementRecord* records, std::size_t n, ElementHandle first){
+      visit(records, n, first);
+    });
+  }
+
+  // Write changed chunks to the file
+  void flush(){
+    _cache.flush();
+  }
+
+  const PageCache::Stats& cache_stats() const{
+    return _cache.stats();
+  }
+
+  std::size_t resident_bytes() const{
+    return _cache.resident_bytes();
+  }
+
+private:
+  ElementHandle check_handle(ElementHandle handle) const{
+    if(handle >= _size){
+      throw std::out_of_range{"No element with this handle"};
+    }
+    return handle;
+  }
+
+  ElementRecord& record(ElementHandle handle, bool write){
+    return _cache.chunk(handle / PageCache::chunk_records, write)[handle % PageCache::chunk_records];
+  }
+
+  // Element `handle`'s record, to be changed; holes throw as in Drawing
+  ElementRecord& live_record(ElementHandle handle){
+    ElementRecord& slot = record(check_handle(handle), true);
+    if(slot.type == removed_element){
+      throw std::out_of_range{"Element has been removed"};
+    }
+    return slot;
+  }
+
+  // Write `n` records over handles [at, at + n), a chunk at a time
+  void store(ElementHandle at, const ElementRecord* records, std::size_t n){
+    std::size_t i = 0;
+    while(i < n){
+      std::size_t offset = (at + i) % PageCache::chunk_records;
+      std::size_t count = std::min(n - i, PageCache::chunk_records - offset);
+      ElementRecord* chunk = _cache.chunk((at + i) / PageCache::chunk_records, true);
+      std::copy(records + i, records + i + count, chunk + offset);
+      i += count;
+    }
+  }
+
+  // Every chunk in order, reading ahead of the one being visited.
+  // The chunks are those there were at the start, so `visit` may
+  // change the size.
+  template<typename Visit>
+  void scan(Visit&& visit, bool write = false) const{
+    std::size_t size = _size;
+    std::size_t chunks = (size + PageCache::chunk_records - 1) / PageCache::chunk_records;
+    std::size_t ahead  = _cache.prefetch_chunks();
+    if(ahead > 0){
+      _cache.prefetch(0, std::min(chunks, ahead + 1));
+    }
+    for(std::size_t c = 0; c < chunks; ++c){
+      // Keep `ahead` chunks requested past this one
+      if(ahead > 0 && c + ahead + 1 < chunks){
+        _cache.prefetch(c + ahead + 1, 1);
+      }
+      ElementHandle first = c * PageCache::chunk_records;
+      visit(_cache.chunk(c, write), std::min(PageCache::chunk_records, size - first), first);
+    }
+  }
+
+  std::string _path;
+  PageCacheOptions _options;
+  // Reads go through the cache too, so it changes under const calls
+  mutable PageCache _cache;
+  std::size_t _size{0};
+  std::size_t _holes{0};
+  Drawing::CompactionOptions _compaction;
+};
+
+// --------------------------------------------------
+// Benchmarks
+//
+// Run with `--bench [count] [--perf] [--trace file.json]`. Rendering goes to a
+// discarding stream buffer, so what's measured is the traversal
+// and the formatting, not the terminal.
+// --------------------------------------------------
+
+// Times `body` over `elements` elements and, if asked, counts events
+template<typename Body>
+void measure(const char* label, std::size_t elements, bool use_perf, Body&& body){
+  std::unique_ptr<PerfCounters> counters; // Opening them costs syscalls; only when asked for
+  if(use_perf){
+    counters.reset(new PerfCounters);
+  }
+  NullBuffer null_buffer;
+  std::chrono::steady_clock::duration elapsed;
+  {
+    CoutRedirect redirect{&null_buffer};
+    if(use_perf){
+      counters->start();
+    }
+    auto start = std::chrono::steady_clock::now();
+    body();
+    elapsed = std::chrono::steady_clock::now() - start;
+    if(use_perf){
+      counters->stop();
+    }
+  }
+
+  double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  std::cout << label << ": " << ns / 1e6 << " ms, "
+            << ns / double(std::max<std::size_t>(1, elements)) << " ns per element" << std::endl;
+  if(use_perf){
+    if(counters->available()){
+      counters->report(std::cout, elements);
+    } else{
+      std::cout << "    (hardware counters unavailable)" << std::endl;
+    }
+  }
+}
+
+int run_benchmarks(std::size_t count, bool use_perf){
+  std::cout << "Benchmarking with " << count << " elements" << std::endl;
+
+  SceneConfig config;
+  config.count = count;
+  SceneGenerator generator{config};
+  // Timed into storage that's already paged in: the first touch
+  // costs more than the generating
+  std::vector<ElementRecord> scene(count);
+  measure("generate scene", count, use_perf, [&]{ generator.fill(scene.data()); });
+
+  Drawing drawing;
+  measure("insert pointers", count, use_perf, [&]{
+    for(const ElementRecord& record: scene){
+      drawing.add_element_ptr(make_element(record).release());
+    }
+  });
+  measure("insert unique pointers", count, use_perf, [&]{
+    for(const ElementRecord& record: scene){
+      drawing.add_element_u_ptr(make_element(record));
+    }
+  });
+
+  measure("render_ptrs", count, use_perf, [&]{ drawing.render_ptrs(); });
+  measure("render_u_ptrs", count, use_perf, [&]{ drawing.render_u_ptrs(); });
+  measure("render_tagged", count, use_perf, [&]{ drawing.render_tagged(); });
+
+  // Whole-drawing transform, first from wherever the elements were
+  // allocated, then from memory local to the node doing the work
+  measure("translate", count, use_perf, [&]{ drawing.translate(1, -1); });
+  drawing.enable_numa();
+  std::cout << "(" << NumaTopology::get().nodes() << " NUMA node(s))" << std::endl;
+  measure("translate, NUMA partitioned", count, use_perf, [&]{ drawing.translate(-1, 1); });
+
+  // Handing the drawing to another process: a full publish, one
+  // after a single update, and a read through a view
+  std::string shared_name = "/ptr-notes-bench-" + std::to_string(::getpid());
+  measure("publish, all elements", count, use_perf, [&]{ drawing.share(shared_name); });
+  if(count > 0){
+    drawing.update(0, [](DrawingElement& element){ element.set_layer(1); });
+  }
+  measure("publish, one update", count, use_perf, [&]{ drawing.publish(); });
+  SharedDrawingView view{shared_name};
+  long long checksum = 0;
+  measure("read shared memory", count, use_perf, [&]{
+    view.read([&](const ElementRecord* records, std::size_t n){
+      checksum = 0;
+      for(std::size_t i = 0; i < n; ++i){
+        checksum += records[i].v[0];
+      }
+    });
+  });
+  std::cout << "(checksum " << checksum << ")" << std::endl;
+  drawing.unshare();
+
+  // Every fourth element removed: rendering around the holes, then
+  // after squeezing them out
+  drawing.set_compaction({1.0, std::numeric_limits<std::size_t>::max()});
+  measure("remove every 4th", count / 4, use_perf, [&]{
+    for(std::size_t i = 0; i < count; i += 4){
+      drawing.remove(i);
+    }
+  });
+  measure("render_tagged, with holes", count, use_perf, [&]{ drawing.render_tagged(); });
+  measure("compact", count, use_perf, [&]{ drawing.compact(); });
+  measure("render_tagged, compacted", count, use_perf, [&]{ drawing.render_tagged(); });
+
+  // A drawing whose handle order doesn't match where its elements
+  // were allocated, as after a long editing session
+  std::vector<std::unique_ptr<DrawingElement>> allocated;
+  for(const ElementRecord& record: scene){
+    allocated.push_back(make_element(record));
+  }
+  std::shuffle(allocated.begin(), allocated.end(), std::minstd_rand{1});
+  Drawing scattered;
+  for(auto& element: allocated){
+    scattered.add_element_u_ptr(std::move(element));
+  }
+  Drawing::DefragmentReport defrag;
+  scattered.set_prefetch_distance(0);
+  measure("render_u_ptrs, scattered", count, use_perf, [&]{ scattered.render_u_ptrs(); });
+  std::size_t distance = scattered.calibrate_prefetch();
+  measure("render_u_ptrs, scattered, prefetched", count, use_perf, [&]{ scattered.render_u_ptrs(); });
+  std::cout << "(prefetch distance " << distance << ")" << std::endl;
+  measure("render_tagged, scattered", count, use_perf, [&]{ scattered.render_tagged(); });
+  measure("defragment", count, use_perf, [&]{ defrag = scattered.defragment(); });
+  measure("render_tagged, defragmented", count, use_perf, [&]{ scattered.render_tagged(); });
+  std::cout << "(";
+  if(defrag.misses_before >= 0){ // Only with hardware counters
+    std::cout << "LLC misses per element: " << defrag.misses_before << " -> " << defrag.misses_after << ", ";
+  }
+  std::cout << "scattered steps: " << defrag.scattered_before << " -> " << defrag.scattered_after << ")" << std::endl;
+
+  // The same drawing paged through a cache a quarter of its size
+  PageCacheOptions page_options;
+  page_options.budget_bytes = count * sizeof(ElementRecord) / 4;
+  PagedDrawing paged{"ptr-notes-bench-" + std::to_string(::getpid()) + ".pages", page_options};
+  measure("paged: insert", count, use_perf, [&]{ paged.add_elements(scene); });
+  measure("paged: translate", count, use_perf, [&]{ paged.translate(1, -1); });
+  measure("paged: stats", count, use_perf, [&]{ paged.stats(); });
+  const PageCache::Stats& cache = paged.cache_stats();
+  std::cout << "(page cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+            << cache.write_backs << " write-backs)" << std::endl;
+
+  // Rendering is dominated by formatting; copying the elements out
+  // shows the cost of the dispatch itself
+  std::vector<std::unique_ptr<DrawingElement>> elements;
+  for(const ElementRecord& record: scene){
+    elements.push_back(make_element(record));
+  }
+  std::vector<ElementRecord> copies(elements.size());
+  measure("copy records, virtual", count, use_perf, [&]{
+    for(std::size_t i = 0; i < elements.size(); ++i){
+      copies[i] = elements[i]->record();
+    }
+  });
+  measure("copy records, tagged", count, use_perf, [&]{
+    for(std::size_t i = 0; i < elements.size(); ++i){
+      copies[i] = record_of(*elements[i]);
+    }
+  });
+
+  // Culling a viewport (1/16 of the canvas) from the geometry
+  // columns, and from the elements themselves
+  Drawing culled;
+  culled.add_elements(scene);
+  Bounds viewport{0, 0, 1 << 14, 1 << 14};
+  std::size_t hits = culled.cull(viewport).size(), element_hits = 0;
+  measure("cull, geometry columns", count, use_perf, [&]{ hits = culled.cull(viewport).size(); });
+  measure("cull, elements", count, use_perf, [&]{
+    element_hits = 0;
+    for(std::size_t i = 0; i < elements.size(); ++i){
+      element_hits += boxes_overlap(bounds(record_of(*elements[i])), viewport);
+    }
+  });
+  std::cout << "(" << hits << " and " << element_hits << " visible)" << std::endl;
+
+  // Clipping every line to the same viewport
+  GeometryColumns line_columns;
+  for(std::size_t i = 0; i < scene.size(); ++i){
+    line_columns.append(scene[i], i);
+  }
+  std::size_t lines = line_columns.line_x1.size();
+  ClippedLines clipped;
+  clip_lines(line_columns, viewport, clipped); // Allocate the output up front
+  measure("clip lines", lines, use_perf, [&]{ clip_lines(line_columns, viewport, clipped); });
+  measure("clip lines, scalar", lines, use_perf, [&]{
+    clipped.reserve(lines);
+    clipped.count = clip_lines_scalar(line_columns.line_x1.data(), line_columns.line_y1.data(),
+                                      line_columns.line_x2.data(), line_columns.line_y2.data(),
+                                      lines, 0, viewport, clipped, 0);
+  });
+  std::cout << "(" << clipped.size() << " of " << lines << " lines kept)" << std::endl;
+
+  // Drawing the lines of a zoomed-in view (1/64 of the canvas) into
+  // a 1024 x 1024 preview, against a per-pixel float rasterizer
+  Framebuffer preview(1024, 1024);
+  Bounds zoomed{0, 0, 1 << 13, 1 << 13};
+  clip_lines(line_columns, zoomed, clipped);
+  double scale = (preview.width() - 1) / double(zoomed.max_x);
+  measure("rasterize lines, Wu", clipped.size(), use_perf, [&]{
+    preview.clear();
+    for(std::size_t i = 0; i < clipped.size(); ++i){
+      draw_line(preview, clipped.x1[i] * scale, clipped.y1[i] * scale, clipped.x2[i] * scale, clipped.y2[i] * scale);
+    }
+  });
+  measure("rasterize lines, per pixel", clipped.size(), use_perf, [&]{
+    preview.clear();
+    for(std::size_t i = 0; i < clipped.size(); ++i){
+      draw_line_per_pixel(preview, float(clipped.x1[i] * scale), float(clipped.y1[i] * scale),
+                                   float(clipped.x2[i] * scale), float(clipped.y2[i] * scale));
+    }
+  });
+
+  // A 4096 x 4096 rendering of the zoomed view and its mip chain;
+  // then one line moved, redrawn and propagated, against rasterizing
+  // and building it all again
+  MipChain chain(4096, 4096);
+  culled.rasterize_lines(chain.base(), zoomed);
+  std::size_t pixels = chain.base().size();
+  measure("mip chain, build", pixels, use_perf, [&]{ chain.build(); });
+  // Moves one element by 64 and returns the region it covered before
+  // and after; an empty region if there's nothing to move
+  ElementHandle moved = clipped.size() > 0 ? clipped.handle[0] : 0;
+  ElementRecord after = scene.empty() ? ElementRecord{} : scene[moved];
+  auto move_one = [&]{
+    if(scene.empty()){
+      return Bounds{0, 0, -1, -1};
+    }
+    ElementRecord before = after;
+    for(int& v: after.v){
+      v += 64;
+    }
+    if(before.type == ElementType::Rectangle){
+      after.v[2] = before.v[2];
+      after.v[3] = before.v[3];
+    }
+    culled.replace(moved, after);
+    Bounds old_bounds = bounds(before), new_bounds = bounds(after);
+    return Bounds{std::min(old_bounds.min_x, new_bounds.min_x), std::min(old_bounds.min_y, new_bounds.min_y),
+                  std::max(old_bounds.max_x, new_bounds.max_x), std::max(old_bounds.max_y, new_bounds.max_y)};
+  };
+  Bounds region = move_one();
+  measure("mip chain, edit in place", 1, use_perf, [&]{
+    chain.update(culled.rasterize_lines(chain.base(), zoomed, region));
+  });
+  measure("mip chain, edit from scratch", 1, use_perf, [&]{
+    chain.base().clear();
+    culled.rasterize_lines(chain.base(), zoomed);
+    chain.build();
+  });
+
+  // Streaming 4K frames of the whole canvas: a key frame, packet by
+  // packet, then a frame with nothing changed and one with a line moved
+  Framebuffer frame(3840, 2160);
+  Bounds canvas{0, 0, 1 << 16, 1 << 16};
+  culled.rasterize_lines(frame, canvas);
+  FrameEncoder encoder;
+  std::size_t key_size = 0, key_packets = 0, unchanged_size = 0, edit_size = 0;
+  double slowest_packet = 0; // Milliseconds
+  measure("encode 4K frame, key", frame.size(), use_perf, [&]{
+    do{
+      auto start = std::chrono::steady_clock::now();
+      key_size += encoder.encode(frame).size();
+      slowest_packet = std::max(slowest_packet, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+      ++key_packets;
+    } while(encoder.tiles_pending() > 0);
+  });
+  std::cout << "(" << key_packets << " packets, slowest " << slowest_packet << " ms)" << std::endl;
+  measure("encode 4K frame, unchanged", frame.size(), use_perf, [&]{ unchanged_size = encoder.encode(frame).size(); });
+  culled.rasterize_lines(frame, canvas, move_one());
+  measure("encode 4K frame, one edit", frame.size(), use_perf, [&]{ edit_size = encoder.encode(frame).size(); });
+  std::cout << "(" << key_size << ", " << unchanged_size << " and " << edit_size << " bytes, of "
+            << frame.size() << " raw)" << std::endl;
+  return 0;
+}
+
+// --------------------------------------------------
+// Render service
+//
+// A daemon hosting Drawings behind a Unix domain socket. Clients
+// send fixed-size commands back to back, as many as they like
+// without waiting (pipelining); the service runs every complete
+// command it has read and writes the responses, in order, in as
+// few writes as it can. One thread serves every connection through
+// epoll, with non-blocking sockets; a connection whose responses
+// aren't being read stops being read from until they drain.
+//
+// Run with `--serve <socket path>`; `--load <socket path>` drives
+// it with a load generator and reports latency and throughput.
+// --------------------------------------------------
+
+#ifdef __linux__
+
+struct ServiceCommand{
+  enum class Op : unsigned char{
+    Add,       // Add element (type, layer, v) to `drawing`, creating it if needed
+    Translate, // Move every element by (v[0], v[1])
+    Render,    // Render into a buffer; responds with its size and checksum
+    Count,     // Responds with the number of points, lines and rectangles
+    Extent,    // Responds with min x, min y, max x, max y
+    Drop       // Destroy the drawing
+  };
+
+  Op            op;
+  ElementType   type;
+  std::int16_t  layer;
+  std::uint32_t drawing;
+  std::uint32_t sequence; // Echoed in the response
+  std::int32_t  v[4];
+};
+
+struct ServiceResponse{
+  enum class Status : unsigned char { Ok, UnknownDrawing, BadCommand };
+
+  std::uint32_t sequence;
+  Status        status;
+  std::int64_t  v[4];
+};
+
+class RenderService{
+public:
+  struct Stats{
+    std::uint64_t connections{0};
+    std::uint64_t commands{0};
+    std::uint64_t writes{0};
+
+    double responses_per_write() const{
+      return writes == 0 ? 0.0 : double(commands) / double(writes);
+    }
+  };
+
+  explicit RenderService(const std::string& path): _path(path){
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)){
+      throw std::runtime_error{"Socket path too long: " + path};
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+
+    _listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ::unlink(path.c_str());
+    if(_listener < 0
+       || ::bind(_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+       || ::listen(_listener, 128) != 0){
+      throw std::runtime_error{"Cannot listen on " + path};
+    }
+    _wakeup = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _epoll  = ::epoll_create1(EPOLL_CLOEXEC);
+    if(_wakeup < 0 || _epoll < 0){
+      throw std::runtime_error{"Cannot create event loop"};
+    }
+    watch(_listener, EPOLLIN);
+    watch(_wakeup, EPOLLIN);
+  }
+
+  ~RenderService(){
+    for(auto& entry: _connections){
+      ::close(entry.first);
+    }
+    ::close(_epoll);
+    ::close(_wakeup);
+    ::close(_listener);
+    ::unlink(_path.c_str());
+  }
+
+  RenderService(const RenderService&) = delete;
+  RenderService& operator=(const RenderService&) = delete;
+
+  // Serve until stop()
+  void run(){
+    epoll_event events[64];
+    while(!_stopping){
+      int ready = ::epoll_wait(_epoll, events, 64, -1);
+      if(ready < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        throw std::runtime_error{"epoll_wait failed"};
+      }
+      for(int i = 0; i < ready; ++i){
+        int fd = events[i].data.fd;
+        if(fd == _listener){
+          accept_all();
+        } else if(fd == _wakeup){
+          _stopping = true;
+        } else{
+          serve(fd, events[i].events);
+        }
+      }
+    }
+  }
+
+  // From any thread, or a signal handler
+  void stop(){
+    std::uint64_t one = 1;
+    ssize_t written = ::write(_wakeup, &one, sizeof(one));
+    (void)written;
+  }
+
+  const Stats& stats() const{
+    return _stats;
+  }
+
+private:
+  // Stop reading a connection once this much output is waiting
+  static constexpr std::size_t max_pending_output = 1 << 20;
+
+  struct Connection{
+    std::vector<char> in;  // Bytes read, not yet a whole command
+    std::vector<char> out; // Responses not yet written
+    std::size_t out_sent{0};
+    std::uint32_t events{EPOLLIN};
+    bool read_closed{false}; // The client has shut down its sending side
+  };
+
+  void watch(int fd, std::uint32_t events){
+    epoll_event event{};
+    event.events  = events;
+    event.data.fd = fd;
+    ::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  void accept_all(){
+    while(true){
+      int fd = ::accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(fd < 0){
+        return; // EAGAIN: no more for now
+      }
+      _connections[fd];
+      watch(fd, EPOLLIN);
+      ++_stats.connections;
+    }
+  }
+
+  void serve(int fd, std::uint32_t events){
+    Connection& connection = _connections[fd];
+    bool open = true;
+    if(!connection.read_closed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+      open = receive(fd, connection);
+    }
+    if(open){
+      open = send(fd, connection);
+    }
+    // A client that has stopped sending still gets every response
+    // to what it sent before; it's closed once they're all written
+    std::size_t pending = connection.out.size() - connection.out_sent;
+    if(!open || (connection.read_closed && pending == 0)){
+      ::epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+      ::close(fd);
+      _connections.erase(fd);
+      return;
+    }
+    // Wait for room to write while output is pending; stop reading
+    // while too much of it is, and after the end of the input
+    bool reading = !connection.read_closed && pending < max_pending_output;
+    std::uint32_t wanted = (pending > 0 ? std::uint32_t(EPOLLOUT) : 0) | (reading ? std::uint32_t(EPOLLIN) : 0);
+    if(wanted != connection.events){
+      epoll_event event{};
+      event.events  = wanted;
+      event.data.fd = fd;
+      ::epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &event);
+      connection.events = wanted;
+    }
+  }
+
+  // Read what's there, running the complete commands after each
+  // read so that neither buffer grows past a read or the output
+  // limit. The end of the input sets `read_closed`; false on errors.
+  bool receive(int fd, Connection& connection){
+    char buffer[64 * 1024];
+    bool open = true;
+    while(connection.out.size() - connection.out_sent < max_pending_output){
+      ssize_t received = ::read(fd, buffer, sizeof(buffer));
+      if(received > 0){
+        connection.in.insert(connection.in.end(), buffer, buffer + received);
+        run_commands(connection);
+      } else if(received < 0 && errno == EINTR){
+        continue;
+      } else if(received == 0){
+        connection.read_closed = true; // A partial command left in `in` is dropped
+        break;
+      } else{
+        open = errno == EAGAIN || errno == EWOULDBLOCK;
+        break;
+      }
+    }
+    return open;
+  }
+
+  // Run every complete command in the input, queueing the responses
+  void run_commands(Connection& connection){
+    std::size_t whole = connection.in.size() / sizeof(ServiceCommand) * sizeof(ServiceCommand);
+    for(std::size_t offset = 0; offset < whole; offset += sizeof(ServiceCommand)){
+      ServiceCommand command;
+      std::memcpy(&command, connection.in.data() + offset, sizeof(command));
+      ServiceResponse response = execute(command);
+      const char* bytes = reinterpret_cast<const char*>(&response);
+      connection.out.insert(connection.out.end(), bytes, bytes + sizeof(response));
+      ++_stats.commands;
+    }
+    connection.in.erase(connection.in.begin(), connection.in.begin() + whole);
+  }
+
+  // Write as much pending output as the socket takes, in one go
+  bool send(int fd, Connection& connection){
+    while(connection.out_sent < connection.out.size()){
+      ssize_t written = ::send(fd, connection.out.data() + connection.out_sent,
+                               connection.out.size() - connection.out_sent, MSG_NOSIGNAL);
+      if(written < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      connection.out_sent += written;
+      ++_stats.writes;
+    }
+    connection.out.clear();
+    connection.out_sent = 0;
+    return true;
+  }
+
+  ServiceResponse execute(const ServiceCommand& command){
+    ServiceResponse response{};
+    response.sequence = command.sequence;
+    response.status   = ServiceResponse::Status::Ok;
+
+    auto found = _drawings.find(command.drawing);
+    if(command.op == ServiceCommand::Op::Add){
+      if(command.type > ElementType::Rectangle){
+        response.status = ServiceResponse::Status::BadCommand;
+        return response;
+      }
+      if(found == _drawings.end()){
+        found = _drawings.emplace(command.drawing, std::unique_ptr<Drawing>{new Drawing}).first;
+      }
+      ElementRecord record{command.type, command.layer, {command.v[0], command.v[1], command.v[2], command.v[3]}};
+      response.v[0] = std::int64_t(found->second->add_element_u_ptr(make_element(record)));
+      return response;
+    }
+    if(found == _drawings.end()){
+      response.status = ServiceResponse::Status::UnknownDrawing;
+      return response;
+    }
+    Drawing& drawing = *found->second;
+
+    switch(command.op){
+    case ServiceCommand::Op::Translate:
+      drawing.translate(command.v[0], command.v[1]);
+      break;
+    case ServiceCommand::Op::Render:{
+      _frame.str("");
+      {
+        CoutRedirect redirect{&_frame};
+        drawing.render_tagged();
+      }
+      const std::string frame = _frame.str();
+      std::uint64_t hash = 14695981039346656037ull; // FNV-1a
+      for(unsigned char c: frame){
+        hash = (hash ^ c) * 1099511628211ull;
+      }
+      response.v[0] = std::int64_t(frame.size());
+      response.v[1] = std::int64_t(hash);
+      break;
+    }
+    case ServiceCommand::Op::Count:{
+      DrawingStats stats = drawing.stats();
+      response.v[0] = std::int64_t(stats.points);
+      response.v[1] = std::int64_t(stats.lines);
+      response.v[2] = std::int64_t(stats.rectangles);
+      break;
+    }
+    case ServiceCommand::Op::Extent:{
+      DrawingStats stats = drawing.stats();
+      response.v[0] = stats.min_x;
+      response.v[1] = stats.min_y;
+      response.v[2] = stats.max_x;
+      response.v[3] = stats.max_y;
+      break;
+    }
+    case ServiceCommand::Op::Drop:{
+      CoutRedirect redirect{&_frame}; // Teardown chatter
+      _drawings.erase(found);
+      break;
+    }
+    default:
+      response.status = ServiceResponse::Status::BadCommand;
+      break;
+    }
+    return response;
+  }
+
+  std::string _path;
+  int _listener{-1};
+  int _wakeup{-1};
+  int _epoll{-1};
+  bool _stopping{false};
+
+  std::map<int, Connection> _connections;
+  std::map<std::uint32_t, std::unique_ptr<Drawing>> _drawings;
+  std::stringbuf _frame; // Render target, reused
+  Stats _stats;
+};
+
+// --------------------------------------------------
+// Load generator
+//
+// Each connection works on a drawing of its own, keeping `depth`
+// batches of `batch` commands in flight. A command's latency runs
+// from the write of its batch to the read of its response.
+// --------------------------------------------------
+
+struct LoadOptions{
+  std::size_t connections{4};
+  std::size_t batch{64};
+  std::size_t depth{8};
+  std::chrono::milliseconds duration{3000};
+  std::size_t render_every{16384}; // One Render per this many commands; 0 for none
+};
+
+class RenderClient{
+public:
+  explicit RenderClient(const std::string& path){
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path)){
+      throw std::runtime_error{"Socket path too long: " + path};
+    }
+    std::copy(path.begin(), path.end(), address.sun_path);
+    _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(_fd < 0 || ::connect(_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0){
+      if(_fd >= 0){
+        ::close(_fd);
+      }
+      throw std::runtime_error{"Cannot connect to " + path};
+    }
+  }
+
+  ~RenderClient(){
+    ::close(_fd);
+  }
+
+  RenderClient(const RenderClient&) = delete;
+  RenderClient& operator=(const RenderClient&) = delete;
+
+  void send(const std::vector<ServiceCommand>& commands){
+    const char* bytes = reinterpret_cast<const char*>(commands.data());
+    std::size_t size = commands.size() * sizeof(ServiceCommand);
+    while(size > 0){
+      ssize_t written = ::send(_fd, bytes, size, MSG_NOSIGNAL);
+      if(written < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        throw std::runtime_error{"Lost connection to the render service"};
+      }
+      bytes += written;
+      size  -= written;
+    }
+  }
+
+  // Block until `count` responses have arrived
+  void receive(std::size_t count, std::vector<ServiceResponse>& responses){
+    responses.resize(count);
+    char* bytes = reinterpret_cast<char*>(responses.data());
+    std::size_t size = count * sizeof(ServiceResponse);
+    while(size > 0){
+      ssize_t received = ::read(_fd, bytes, size);
+      if(received <= 0){
+        if(received < 0 && errno == EINTR){
+          continue;
+        }
+        throw std::runtime_error{"Lost connection to the render service"};
+      }
+      bytes += received;
+      size  -= received;
+    }
+  }
+
+private:
+  int _fd;
+};
+
+inline int run_load(const std::string& path, LoadOptions options = {}){
+  using Clock = std::chrono::steady_clock;
+  std::cout << "Load: " << options.connections << " connections, " << options.depth
+            << " batches of " << options.batch << " commands in flight each" << std::endl;
+
+  std::vector<std::vector<double>> latencies(options.connections); // Microseconds
+  std::vector<std::string> errors(options.connections);
+  Clock::time_point start = Clock::now();
+  Clock::time_point end   = start + options.duration;
+
+  std::vector<std::thread> threads;
+  for(std::size_t c = 0; c < options.connections; ++c){
+    threads.emplace_back([&, c]{
+      try{
+        RenderClient client{path};
+        SceneConfig config;
+        config.seed = c;
+        SceneGenerator generator{config};
+
+        std::uint32_t drawing  = std::uint32_t(::getpid()) * 64 + std::uint32_t(c);
+        std::uint32_t sequence = 0;
+        std::vector<ServiceCommand> commands(options.batch);
+        auto next_batch = [&]{
+          for(ServiceCommand& command: commands){
+            command = ServiceCommand{};
+            command.drawing  = drawing;
+            command.sequence = sequence;
+            std::size_t n = sequence++;
+            if(options.render_every != 0 && n % options.render_every == options.render_every - 1){
+              command.op = ServiceCommand::Op::Render;
+            } else if(n % 1024 == 1023){
+              command.op = n % 2048 == 1023 ? ServiceCommand::Op::Count : ServiceCommand::Op::Extent;
+            } else if(n % 1024 == 1022){
+              command.op = ServiceCommand::Op::Translate;
+              command.v[0] = 1;
+            } else{
+              ElementRecord record = generator.element(n);
+              command.op    = ServiceCommand::Op::Add;
+              command.type  = record.type;
+              command.layer = record.layer;
+              std::copy(record.v, record.v + 4, command.v);
+            }
+          }
+        };
+
+        std::vector<Clock::time_point> sent; // Of the batches in flight, oldest first
+        std::vector<ServiceResponse> responses;
+        while(true){
+          while(sent.size() < options.depth && Clock::now() < end){
+            next_batch();
+            client.send(commands);
+            sent.push_back(Clock::now());
+          }
+          if(sent.empty()){
+            break;
+          }
+          client.receive(options.batch, responses);
+          double us = std::chrono::duration<double, std::micro>(Clock::now() - sent.front()).count();
+          latencies[c].insert(latencies[c].end(), options.batch, us);
+          sent.erase(sent.begin());
+        }
+
+        ServiceCommand drop{};
+        drop.op      = ServiceCommand::Op::Drop;
+        drop.drawing = drawing;
+        client.send({drop});
+        client.receive(1, responses);
+      } catch(const std::exception& e){
+        errors[c] = e.what();
+      }
+    });
+  }
+  for(auto& thread: threads){
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  for(const std::string& error: errors){
+    if(!error.empty()){
+      std::cerr << "** " << error << std::endl;
+      return 1;
+    }
+  }
+  std::vector<double> all;
+  for(auto& part: latencies){
+    all.insert(all.end(), part.begin(), part.end());
+  }
+  if(all.empty()){
+    std::cout << "No commands completed" << std::endl;
+    return 1;
+  }
+  auto percentile = [&](double p){
+    std::size_t rank = std::min(all.size() - 1, std::size_t(p * double(all.size())));
+    std::nth_element(all.begin(), all.begin() + rank, all.end());
+    return all[rank];
+  };
+  std::cout << all.size() << " commands in " << seconds << " s: "
+            << double(all.size()) / seconds << " commands/s" << std::endl;
+  std::cout << "latency p50: " << percentile(0.50) << " us, p99: " << percentile(0.99) << " us" << std::endl;
+  return 0;
+}
+
+#endif
+
+// --------------------------------------------------
+// --------------------------------------------------
+// --------------------------------------------------
+
+// How to run the program; returns the exit status for bad arguments
+int usage(const char* program){
+  std::cerr << "Usage: " << program << " [--bench [elements] [--perf] [--trace <file>]]" << std::endl
+            << "       " << program << " --serve <socket>" << std::endl
+            << "       " << program << " --load <socket> [seconds] [connections]" << std::endl
+            << "       " << program << " --view <shared drawing>" << std::endl;
+  return 2;
+}
+
+// A whole, non-negative number, all of `arg`; false for anything else
+bool parse_count(const std::string& arg, std::size_t& value){
+  if(arg.empty() || arg[0] < '0' || arg[0] > '9'){
+    return false; // std::stoul would skip spaces and wrap "-1" around
+  }
+  try{
+    std::size_t used = 0;
+    value = std::stoul(arg, &used);
+    return used == arg.size();
+  } catch(const std::out_of_range&){
+    return false;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc > 1 && std::string{argv[1]} == "--bench"){
+    std::size_t count = 1000000;
+    bool use_perf = false;
+    std::string trace_path;
+    for(int i = 2; i < argc; ++i){
+      std::string arg{argv[i]};
+      if(arg == "--perf"){
+        use_perf = true;
+      } else if(arg == "--trace" && i + 1 < argc){
+        trace_path = argv[++i];
+      } else if(!parse_count(arg, count)){
+        return usage(argv[0]);
+      }
+    }
+    Tracer::enable(!trace_path.empty());
+    int result = run_benchmarks(count, use_perf);
+    if(!trace_path.empty()){
+      std::ofstream trace{trace_path};
+      Tracer::write_chrome_json(trace);
+    }
+    return result;
+  }
+
+#ifdef __linux__
+  // Host drawings on a Unix socket until interrupted
+  if(argc > 2 && std::string{argv[1]} == "--serve"){
+    static RenderService* service = nullptr;
+    RenderService instance{argv[2]};
+    service = &instance;
+    auto stop = [](int){ service->stop(); };
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    std::cout << "Serving on " << argv[2] << std::endl;
+    instance.run();
+    const RenderService::Stats& stats = instance.stats();
+    std::cout << stats.commands << " commands from " << stats.connections << " connections, "
+              << stats.responses_per_write() << " responses per write" << std::endl;
+    return 0;
+  }
+
+  // Load-test a running service: `--load <socket> [seconds] [connections]`
+  if(argc > 2 && std::string{argv[1]} == "--load"){
+    LoadOptions options;
+    std::size_t seconds = 0;
+    if(argc > 3){
+      if(!parse_count(argv[3], seconds)){
+        return usage(argv[0]);
+      }
+      options.duration = std::chrono::milliseconds{seconds * 1000};
+    }
+    if(argc > 4 && !parse_count(argv[4], options.connections)){
+      return usage(argv[0]);
+    }
+    return run_load(argv[2], options);
+  }
+#endif
+
+  // Render a drawing shared by another process
+  if(argc > 2 && std::string{argv[1]} == "--view"){
+    SharedDrawingView view{argv[2]};
+    view.render();
+    return 0;
+  }
+
   // Creating Drawing
   Drawing drawing;
   // drawing.draw();